@@ -33,21 +33,21 @@ int main(int argc, char **argv) {
     
     char *data_buf = malloc(DATA_BUF_SIZE);
     
-    struct pinner_physlist sg_plist;
+    struct pinner_physlist *sg_plist = physlist_new(PINNER_PHYSLIST_WORST_CASE(5000));
     struct pinner_handle sg_handle;
-    int rc = pin_buf(pinner_fd, sg_buf, 5000, &sg_handle, &sg_plist);
+    int rc = pin_buf(pinner_fd, sg_buf, 5000, &sg_handle, sg_plist);
     if (rc < 0) {
         return -1;
     }
     
-    struct pinner_physlist data_plist;
+    struct pinner_physlist *data_plist = physlist_new(PINNER_PHYSLIST_WORST_CASE(DATA_BUF_SIZE));
     struct pinner_handle data_handle;
-    rc = pin_buf(pinner_fd, data_buf, DATA_BUF_SIZE, &data_handle, &data_plist);
+    rc = pin_buf(pinner_fd, data_buf, DATA_BUF_SIZE, &data_handle, data_plist);
     if (rc < 0) {
         return -1;
     }
     
-    sg_list *lst = axidma_list_new(sg_buf, &sg_plist, data_buf, &data_plist);
+    sg_list *lst = axidma_list_new(sg_buf, sg_plist, data_buf, data_plist);
     
     for (int i = 0; i < NUM_BUFFERS; i++) {
         rc = axidma_add_entry(lst, BUFFER_SZ);
@@ -92,6 +92,10 @@ int main(int argc, char **argv) {
     
     unpin_buf(pinner_fd, &data_handle);
     unpin_buf(pinner_fd, &sg_handle);
+    free(data_plist);
+    free(sg_plist);
+    free(data_buf);
+    free(sg_buf);
     
     pinner_close(pinner_fd);
     return 0;
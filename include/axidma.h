@@ -9,88 +9,226 @@
 //Started adding these version tags, cause I'm starting to lose track of what's
 //going on. This code needs to be maintained in several places
 #define AXIDMA_USERLIB_VERSION_MAJOR 1
-#define AXIDMA_USERLIB_VERSION_MINOR 7
+#define AXIDMA_USERLIB_VERSION_MINOR 30
 
 #include "pinner.h"
 
 
 #define AXIDMA_NOT_FOUND 0xFFFFFFFF
 
+//Values for the wait_irq argument of the transfer functions. 0 and 1 still 
+//mean what they always did
+#define AXIDMA_NO_WAIT      0
+#define AXIDMA_WAIT_IRQ     1 //Block in read() until the interrupt
+#define AXIDMA_WAIT_POLL    2 //Spin on the last descriptor's complete bit
+#define AXIDMA_WAIT_HYBRID  3 //Spin for a while, then block like AXIDMA_WAIT_IRQ
+
+//How long AXIDMA_WAIT_HYBRID spins before blocking, unless you change it with 
+//axidma_set_spin_budget
+#define AXIDMA_DEFAULT_SPIN_NS 50000
+
+//Default value for the AXI DMA's IRQDelay field (used when you enable the 
+//timeout). Measured in units of 125 SG clock cycles
+#define AXIDMA_DEFAULT_IRQ_DELAY 200
+
+//How often adaptive coalescing re-tunes the threshold
+#define AXIDMA_COALESCE_WINDOW_NS 10000000
+
+//Vivado's default "Width of Buffer Length Register" for the AXI DMA is 14 bits.
+//Use axidma_set_buf_len_width if you changed it
+#define AXIDMA_DEFAULT_BUF_LEN_WIDTH 14
+
 //This cleans up the code slightly. I didn't use a typedef because I was worried
 //about conflicts once this becomes a shared library.
 #define handle  struct pinner_handle
 #define physlist struct pinner_physlist
 
-//Format of a scatter-gather descriptor
+//Format of a scatter-gather descriptor. Every field is a little-endian 32-bit
+//word; use the masks below for control and status instead of bitfields, so 
+//that each field is one load or store
 typedef struct {
-    unsigned next_desc_lsb  :32; //Big or little endian?
-    unsigned next_desc_msb  :32;
-    unsigned buffer_lsb     :32;
-    unsigned buffer_msb     :32;
-    unsigned long           :64; //unused
-    
-    struct {
-        unsigned len        :26;
-        unsigned eof        :1;
-        unsigned sof        :1;
-        unsigned            :4;
-    } control;
-    
-    struct {
-        unsigned len        :26;
-        unsigned eof        :1;
-        unsigned sof        :1;
-        unsigned int_err    :1;
-        unsigned slave_err  :1;
-        unsigned decode_err :1;
-        unsigned complete   :1;
-    } status;
-    
-    unsigned app0           :32;
-    unsigned app1           :32;
-    unsigned app2           :32;
-    unsigned app3           :32;
-    unsigned app4           :32;
+    uint32_t next_desc_lsb;
+    uint32_t next_desc_msb;
+    uint32_t buffer_lsb;
+    uint32_t buffer_msb;
+    uint32_t reserved[2];
+    uint32_t control;
+    uint32_t status;
+    uint32_t app[5];
+    uint32_t pad[3]; //Descriptors are 16-word aligned anyway
 } sg_descriptor;
 
+//Bits in the control word
+#define SG_CTRL_LEN_MASK    0x03FFFFFFu
+#define SG_CTRL_EOF         (1u << 26)
+#define SG_CTRL_SOF         (1u << 27)
+
+//Bits in the status word
+#define SG_STS_LEN_MASK     0x03FFFFFFu
+#define SG_STS_EOF          (1u << 26)
+#define SG_STS_SOF          (1u << 27)
+#define SG_STS_INT_ERR      (1u << 28)
+#define SG_STS_SLV_ERR      (1u << 29)
+#define SG_STS_DEC_ERR      (1u << 30)
+#define SG_STS_ERR_MASK     (SG_STS_INT_ERR | SG_STS_SLV_ERR | SG_STS_DEC_ERR)
+#define SG_STS_COMPLETE     (1u << 31)
+
 /*
- * Node in a linked list of scatter-gather list entries
+ * Bookkeeping for one scatter-gather descriptor. These are kept in a flat 
+ * array inside the sg_list, in the same order as the descriptor chain
 */
-typedef struct _sg_entry {
-    //Linked list of sg_entry structs
-    struct _sg_entry *prev;
-    struct _sg_entry *next;
+typedef struct {
+    //Fields in the ADI DMA SG entry
+    uint64_t buf_phys;
+    uint64_t sg_phys; //Physical address of this descriptor. Saves us from 
+                      //looking it up when linking descriptors together
     
     //Offset into virtual memory. 
     unsigned sg_offset; //Used when writing the SG list to memory.
     unsigned data_offset; //Used when returning data to user
     
-    //Fields in the ADI DMA SG entry
-    //unsigned long nextdesc_phys; //Can (and should) compute this on the fly
-    uint64_t buf_phys;
     unsigned len;    
-    int is_SOF;
-    int is_EOF;
+    unsigned char is_SOF;
+    unsigned char is_EOF;
+    
+    unsigned slot; //Index into the list's slots. Only used when leasing
 } sg_entry;
 
+/*
+ * A piece of the data buffer that one descriptor can point at. When leasing,
+ * a descriptor's slot can be swapped for a spare one while the application 
+ * holds on to the old one
+*/
+typedef struct {
+    uint64_t phys;
+    unsigned data_offset;
+    unsigned len;
+    unsigned char leased; //Application owns it
+    unsigned char on_ring; //Some descriptor points at it
+    unsigned next; //Next slot in the same packet (while leased)
+} sg_slot;
+
+/*
+ * Lookup index for a physlist, so that converting an offset in the buffer into
+ * a physlist entry doesn't need a linear search. Built once in axidma_list_new
+*/
+typedef struct {
+    physlist const *plist;
+    unsigned *starts; //starts[i] is the offset of entry i from the start of 
+                      //the buffer, and starts[num_entries] is the total size
+    
+    //If all the entries (except maybe the last) are stride bytes long, 
+    //ignoring the first one, we can find the entry with a division instead of
+    //a binary search. This is the usual case, since entries are pages.
+    //Set to 0 if the physlist isn't uniform
+    unsigned stride;
+} physlist_index;
+
+/*
+ * How the descriptors in an sg_list are being used by the AXI DMA
+*/
+typedef enum {
+    SG_LIST_ONESHOT, //Hardware walks the list once, then stops
+    SG_LIST_RING,    //Descriptors are handed back to the hardware as they are consumed
+    SG_LIST_CYCLIC,  //Hardware loops around the list forever (CYC_BD_EN)
+    SG_LIST_APPEND   //New entries are linked on to the running channel
+} sg_list_mode;
+
 /*
  * Struct which manages a scatter-gather list. It allows you to "allocate" 
  * buffers from the data buffer while updating the scatter-gather list entries
 */
 typedef struct {
-    sg_entry sentinel; //Head of linked list of sg_entries
-    sg_entry *to_vist; //Used when returning buffer statuses
+    //Array of sg_entries. It is allocated once in axidma_list_new with room 
+    //for as many descriptors as could possibly fit in the SG buffer, so adding
+    //and clearing entries never allocates anything
+    sg_entry *entries;
+    unsigned capacity;
+    unsigned num_entries;
+    
+    //Index of the next entry to visit when returning buffer statuses. Set to
+    //AXIDMA_NOT_FOUND when there is nothing to visit
+    unsigned to_vist;
+    
+    //Ring mode bookkeeping. Entries from to_release up to (but not including)
+    //to_vist have been dequeued, but not yet given back to the hardware. There
+    //are num_held of them
+    sg_list_mode mode;
+    unsigned to_release;
+    unsigned num_held;
+    
+    //Longest packet the stream sends (see axidma_set_max_packet). Ring, lease
+    //and cyclic mode need every buffer to be at least this big
+    unsigned max_packet;
+    
+    //Total number of packets dequeued so far. Used for adaptive coalescing
+    unsigned num_dequeued;
+    
+    //Descriptors 0 to num_written-1 are already in memory, so rewriting the 
+    //list only has to reset their status
+    unsigned num_written;
+    //Descriptors 0 to num_dirty-1 may have a status from the hardware (they 
+    //were handed to it or dequeued). The rest still have a status of 0
+    unsigned num_dirty;
+    
+    //Append mode: entries 0 to num_submitted-1 have been given to the hardware
+    unsigned num_submitted;
+    //Append mode: where the last submitted descriptor's next pointer goes (the
+    //slot the next entry will use), or 0 if the SG buffer is full
+    uint64_t prelink_phys;
+    
+    //Leasing. The first num_entries slots start out belonging to the 
+    //descriptors, and the rest are spares. spares[] is a stack of slots that 
+    //aren't on the ring or leased
+    int leasing;
+    sg_slot *slots;
+    unsigned num_slots;
+    unsigned *spares;
+    unsigned num_spares;
+    unsigned num_leased; //Slots the application is holding
     
     void *sg_buf; //User virtual address to start of SG entry memory
     unsigned sg_offset; //Offset into sg_buf where next SG entry will go
     physlist const *sg_plist; //Phyiscal address information for SG list
+    physlist_index sg_idx;
+    
+    //Longest buffer a single descriptor can describe. Physlist entries can be
+    //much bigger than this, since the pinner merges contiguous pages
+    unsigned max_desc_len;
     
     void *data_buf; //User virtual address to start of data memory
     unsigned data_offset; //Offset into data_buf where next buffer will be allocated
     physlist const *data_plist; //Physical address information for data buffer
+    physlist_index data_idx;
+    
+    //If data_sync_h isn't NULL, each S2MM packet is synced for the CPU (just 
+    //the bytes that were received) as it's dequeued
+    int data_sync_fd;
+    handle *data_sync_h;
 } sg_list;
 
 
+typedef enum {
+    AXIDMA_MM2S,
+    AXIDMA_S2MM
+} axidma_chan_id;
+
+/*
+ * Interrupt coalescing settings for one channel
+*/
+typedef struct {
+    unsigned threshold; //0 means pick automatically
+    unsigned delay; //IRQDelay to use when the timeout is enabled
+    
+    //Adaptive mode. 0 means off
+    unsigned target_irq_rate; //Interrupts per second
+    
+    //Adaptive mode state
+    unsigned cur_threshold;
+    uint64_t window_start_ns;
+    unsigned window_start_pkts;
+} axidma_coalesce;
+
 /*
  * Holds whatever state is needed per process
 */
@@ -100,13 +238,28 @@ typedef struct {
     
     //Keeps track of which sg_list was written to physical memory
     sg_list *lst;
+    sg_list *mm2s_lst; //Same thing, but for the MM2S channel
+    
+    unsigned spin_ns; //How long AXIDMA_WAIT_HYBRID spins before blocking
+    unsigned irq_count; //Interrupt count from the last time we read the UIO fd
+    int irq_control; //1 if the UIO driver needs a write to unmask the interrupt
+    
+    axidma_coalesce coalesce[2]; //Indexed by axidma_chan_id
+    
+    //Ping-pong mode (see axidma_pingpong_start)
+    sg_list **pp_lists;
+    unsigned pp_num;
+    unsigned pp_next; //Next list axidma_pingpong_wait will return
+    unsigned pp_release; //Next list axidma_pingpong_release gives back
+    unsigned pp_held; //Lists returned but not released yet
 } axidma_ctx;
 
 
 typedef enum {
     TRANSFER_SUCCESS,
     TRANSFER_FAILED,
-    END_OF_LIST
+    END_OF_LIST,
+    NOT_READY //Ring/cyclic mode only: the hardware hasn't finished the next buffer yet
 } buf_code;
 
 /*
@@ -116,12 +269,50 @@ typedef struct {
     void *base;
     unsigned len;
     buf_code code;
+    unsigned id; //Pass the buffer to axidma_s2mm_release_buf when leasing
 } s2mm_buf;
 
+/*
+ * Info about a buffer sent by the AXI DMA. Same as an s2mm_buf, except len is 
+ * the number of bytes the AXI DMA actually read out of memory
+*/
+typedef s2mm_buf mm2s_buf;
+
 //Functions to open and close an AXI DMA context.
 axidma_ctx* axidma_open(char const* path);
 void axidma_close(axidma_ctx *ctx);
 
+//Sets how many nanoseconds AXIDMA_WAIT_HYBRID spins before it blocks
+void axidma_set_spin_budget(axidma_ctx *ctx, unsigned spin_ns);
+
+/*
+ * Sets the interrupt coalescing for a channel. The AXI DMA raises an interrupt
+ * after threshold packets (1 to 255), or once delay (1 to 255, in units of 125
+ * SG clock cycles) has passed with no new packets. The delay only applies to 
+ * transfers started with enable_timeout, so leave that off if you don't want
+ * a timeout; a delay of 0 is rejected.
+ * 
+ * A threshold of 0 (the default) means one interrupt per one-shot transfer, 
+ * and one per packet in ring or cyclic mode. If you pick a threshold yourself,
+ * a one-shot transfer with a packet count that isn't a multiple of it can 
+ * only finish with an interrupt by timing out.
+ * 
+ * Takes effect on the next transfer, or right away in ring/cyclic mode. 
+ * Returns 0 on success, -1 on bad arguments. This turns off adaptive mode
+*/
+int axidma_set_coalesce(axidma_ctx *ctx, axidma_chan_id chan, unsigned threshold, unsigned delay);
+
+/*
+ * Turns on adaptive coalescing for a channel in ring or cyclic mode, or turns
+ * it off if target_irq_rate is 0. Every AXIDMA_COALESCE_WINDOW_NS, the library
+ * measures how fast you're dequeueing packets and picks a threshold that gives
+ * roughly target_irq_rate interrupts per second. The delay timer is always on 
+ * in this mode, so a burst's last few packets don't get stuck.
+ * 
+ * Retuning happens in axidma_s2mm_ring_release and the harvest functions
+*/
+int axidma_set_adaptive_coalesce(axidma_ctx *ctx, axidma_chan_id chan, unsigned target_irq_rate);
+
 //Functions to create and delete an sg_list objext
 sg_list *axidma_list_new(void *sg_buf, physlist const *sg_plist,
                          void *data_buf, physlist const *data_plist);
@@ -137,6 +328,14 @@ typedef enum {
     ADD_ENTRY_ERROR
 } add_entry_code;
 
+/*
+ * Tells the library how wide the AXI DMA's buffer length register is (this is
+ * the "Width of Buffer Length Register" setting in Vivado). Physically 
+ * contiguous chunks longer than the register allows are split across several
+ * descriptors. Only affects entries added after calling this.
+*/
+void axidma_set_buf_len_width(sg_list *lst, unsigned width);
+
 /*
  * Apportions a new buffer from the the user's data buffer, and appends the
  * necessary entries to the SG list
@@ -147,34 +346,259 @@ typedef enum {
 add_entry_code axidma_add_entry(sg_list *lst, unsigned sz);
 
 /*
- * Clears all the entries in an sg_list 
+ * For MM2S lists. Appends the SG entries needed to send the sz bytes starting 
+ * at buf as a single packet (i.e. SOF on the first entry and EOF on the last).
+ * buf must point somewhere inside the list's data buffer, but it doesn't have 
+ * to be a buffer that came from axidma_add_entry, so you can gather packets 
+ * from wherever you already put them. Return codes are the same as 
+ * axidma_add_entry
+*/
+add_entry_code axidma_add_mm2s_entry(sg_list *lst, void *buf, unsigned sz);
+
+/*
+ * Clears all the entries in an sg_list, so you can start apportioning the data
+ * buffer from the beginning again. This doesn't free anything.
 */
 void axidma_clear_list(sg_list *lst);
 
 /*
  * Writes SG list to physical memory. Call this _before_ starting your trasnfer!
+ * 
+ * Writing the same list again (to reuse it) only resets the status of the 
+ * descriptors the hardware used, plus writes any entries added since last 
+ * time. On aarch64 the touched cache lines are cleaned directly; elsewhere the
+ * pinner is asked to sync that part of h, and you can pass NULL to skip that 
+ * if your SG buffer is coherent.
+ * 
+ * If you used lease mode, give back every leased buffer with 
+ * axidma_s2mm_release_buf first. The list isn't written while any are held.
 */
 
 void axidma_write_sg_list(axidma_ctx *ctx, sg_list *lst, int pinner_fd, handle *h);
 
+/*
+ * Same as axidma_write_sg_list, but the list will be used by the MM2S channel.
+ * Don't forget to flush the data buffer too, since the AXI DMA will be reading
+ * it!
+*/
+void axidma_write_mm2s_sg_list(axidma_ctx *ctx, sg_list *lst, int pinner_fd, handle *h);
+
 /*
  * Writes the scatter-gather list entries to memory, then starts the transfer.
- * Set wait_irq to 0 if you don't want to wait for the interrupt
+ * Set wait_irq to 0 if you don't want to wait for the interrupt. 
+ * 
+ * AXIDMA_WAIT_POLL doesn't use interrupts at all; it spins until the hardware 
+ * sets the complete bit in the last descriptor, so you find out as soon as it 
+ * happens (as long as the SG buffer is cache-coherent). This also means it 
+ * won't return early because of the timeout or because not enough packets 
+ * arrived. AXIDMA_WAIT_HYBRID spins for a bounded time, then falls back to 
+ * waiting for the interrupt
  * CALL axidma_write_sg_list FIRST!
  * TODO: find nice way to decouple from pinner_fns
 */
 void axidma_s2mm_transfer(axidma_ctx *ctx, int wait_irq, int enable_timeout);
 
 /*
- * Used for traversing buffers returned from an S2MM trasnfer
+ * Starts sending the packets in the list written by axidma_write_mm2s_sg_list.
+ * The arguments mean the same thing as in axidma_s2mm_transfer
+*/
+void axidma_mm2s_transfer(axidma_ctx *ctx, int wait_irq, int enable_timeout);
+
+/*
+ * Tells the library the longest packet (in bytes) the stream will ever send. 
+ * Ring, lease and cyclic mode need this: every packet has to fit in the buffer
+ * it starts in, since a packet that ran on from the last buffer to the first 
+ * one wouldn't be contiguous in memory. Their start functions refuse lists 
+ * where a buffer is smaller than max_packet
+*/
+void axidma_set_max_packet(sg_list *lst, unsigned max_packet);
+
+/*
+ * Starts the S2MM channel in ring mode, using the list written by 
+ * axidma_write_sg_list. The last descriptor is linked back to the first, and 
+ * instead of stopping at the end of the list, the hardware keeps going as long 
+ * as you keep giving descriptors back with axidma_s2mm_ring_release. Use 
+ * axidma_dequeue_s2mm_buf to get the buffers as they arrive; it will return 
+ * NOT_READY instead of waiting.
+ * 
+ * Call axidma_set_max_packet first. Each packet comes back in exactly one of 
+ * the buffers you added; one that is longer than its buffer (so the stream 
+ * broke the limit you set) comes back as TRANSFER_FAILED.
+ * 
+ * This never flushes the SG buffer, so it only works if the AXI DMA's view of 
+ * the SG buffer is cache-coherent (see modules/axidma/README.md).
+*/
+void axidma_s2mm_ring_start(axidma_ctx *ctx, int enable_timeout);
+
+/*
+ * Gives every buffer you've dequeued so far back to the hardware by resetting 
+ * their descriptors and moving S2MM_taildesc up to the last one. Don't touch 
+ * those buffers after calling this, since the hardware will fill them again.
+*/
+void axidma_s2mm_ring_release(axidma_ctx *ctx);
+
+/*
+ * Carves count spare buffers of sz bytes out of the data buffer, after the 
+ * entries you already added (so call this last). They're used by lease mode to
+ * keep the ring going while you hold on to buffers. sz has to be at least as 
+ * big as each descriptor's buffer. Returns the number of spares actually added
+*/
+unsigned axidma_add_spare_bufs(sg_list *lst, unsigned sz, unsigned count);
+
+/*
+ * Starts the S2MM channel in lease mode. This is ring mode, except every 
+ * buffer you dequeue belongs to you until you give it back with 
+ * axidma_s2mm_release_buf, and you can give them back in any order. Whenever 
+ * the library re-arms a descriptor whose buffer you're still holding, it swaps 
+ * in a spare buffer instead, so the hardware only stalls if you're holding 
+ * more buffers than there are spares.
+ * 
+ * Descriptors are re-armed in axidma_s2mm_release_buf, axidma_s2mm_ring_release
+ * and axidma_s2mm_harvest. Packets have to fit in one descriptor: a packet that
+ * spans several descriptors is only returned as TRANSFER_SUCCESS if its 
+ * buffers are still next to each other in memory.
+ * Returns 0 on success, -1 on error
+*/
+int axidma_s2mm_lease_start(axidma_ctx *ctx, int enable_timeout);
+
+/*
+ * Gives a buffer returned in lease mode back to the library. Returns 0 on 
+ * success, -1 if buf wasn't leased
+*/
+int axidma_s2mm_release_buf(axidma_ctx *ctx, s2mm_buf const *buf);
+
+/*
+ * Starts the S2MM channel in cyclic mode. This is like ring mode, except the 
+ * hardware never waits for you: it keeps looping around the list and will 
+ * overwrite buffers you haven't dequeued yet. In exchange, there is nothing to
+ * release and no registers are touched after this function returns. 
+ * axidma_dequeue_s2mm_buf tracks where the hardware is by clearing each 
+ * descriptor's status as it returns the buffer. The same cache-coherence 
+ * caveat as ring mode applies.
+*/
+void axidma_s2mm_cyclic_start(axidma_ctx *ctx, int enable_timeout);
+
+/*
+ * Starts the S2MM channel in ping-pong mode with n lists (two or more, 
+ * normally), each of which must already have been written with 
+ * axidma_write_sg_list. The lists are chained into a loop, and the hardware 
+ * fills them one after the other while you work on the ones it has finished.
+ * 
+ * The same cache-coherence caveat as ring mode applies. Returns 0 on success, 
+ * -1 on error
+*/
+int axidma_pingpong_start(axidma_ctx *ctx, sg_list **lsts, unsigned n, int enable_timeout);
+
+/*
+ * Waits (according to wait_irq, as in axidma_s2mm_transfer) until the hardware
+ * has filled the next list, and returns it. Use axidma_dequeue_s2mm_buf on it 
+ * as usual. Returns NULL if the list isn't done (always possible with 
+ * AXIDMA_NO_WAIT) or every list is already held
+*/
+sg_list *axidma_pingpong_wait(axidma_ctx *ctx, int wait_irq);
+
+/*
+ * Gives the oldest list returned by axidma_pingpong_wait back to the hardware
+*/
+void axidma_pingpong_release(axidma_ctx *ctx);
+
+/*
+ * Gives the hardware any entries added to lst since the last call, without 
+ * stopping the channel. The first call (or any call after the channel stops, 
+ * or after you clear the list) writes the whole list and starts the channel. 
+ * After that, new descriptors are linked on after the current tail, and only 
+ * the taildesc register is written. You can keep adding entries and 
+ * submitting them while the hardware works.
+ * 
+ * Use the dequeue functions to get finished buffers; they return NOT_READY 
+ * when they catch up with the hardware. Once the list is out of room, wait 
+ * until everything is dequeued, then clear it and start over. Like ring mode,
+ * this doesn't flush the SG buffer. Returns 0 on success, -1 on error
+*/
+int axidma_s2mm_submit(axidma_ctx *ctx, sg_list *lst, int enable_timeout);
+int axidma_mm2s_submit(axidma_ctx *ctx, sg_list *lst, int enable_timeout);
+
+/*
+ * Stops the S2MM channel and waits for it to halt. Needed to get out of ring 
+ * or cyclic mode; afterwards you can start a new transfer.
+*/
+void axidma_s2mm_stop(axidma_ctx *ctx);
+
+/*
+ * Simple (register) mode, for an AXI DMA built without the SG engine. Moves 
+ * len bytes to or from the physically contiguous memory at phys, e.g. a buffer 
+ * from alloc_coherent_buf with PINNER_ALLOC_CONTIG (where phys is 
+ * plist->entries[0].addr plus your offset). len can't be more than what the 
+ * buffer length register holds (at most 2^26 - 1 bytes).
+ * 
+ * Returns the number of bytes moved (for S2MM, the length of the packet that 
+ * was received), or -1 on error. With AXIDMA_NO_WAIT it returns 0 right away,
+ * and you call axidma_simple_wait later to get the result
+*/
+int axidma_simple_transfer(axidma_ctx *ctx, axidma_chan_id chan, uint64_t phys, unsigned len, int wait_irq);
+int axidma_simple_wait(axidma_ctx *ctx, axidma_chan_id chan, int wait_irq);
+
+/*
+ * Used for traversing buffers returned from an S2MM trasnfer. In ring or cyclic
+ * mode, this wraps around and returns NOT_READY if the next buffer isn't done 
+ * yet
 */
 s2mm_buf axidma_dequeue_s2mm_buf(sg_list *lst);
 
+/*
+ * Used for traversing the packets sent in an MM2S transfer. Unlike S2MM, the 
+ * packet boundaries are the ones you chose when building the list
+*/
+mm2s_buf axidma_dequeue_mm2s_buf(sg_list *lst);
+
+/*
+ * Same as calling the dequeue functions over and over, but a lot cheaper per 
+ * packet. Fills out[] with up to max buffers and returns how many it found. In
+ * a one-shot list, returning fewer than max means you hit the end of the list.
+ * In ring or cyclic mode, it means the hardware hasn't finished the next one
+*/
+int axidma_dequeue_s2mm_batch(sg_list *lst, s2mm_buf *out, int max);
+int axidma_dequeue_mm2s_batch(sg_list *lst, mm2s_buf *out, int max);
+
+/*
+ * Makes the S2MM dequeue functions sync each packet's bytes for the CPU 
+ * (using the pinner's PINNER_SYNC_RANGE) before returning it. data_h is the 
+ * handle you got when pinning the data buffer. Pass NULL to turn this off
+*/
+void axidma_set_data_sync(sg_list *lst, int pinner_fd, handle *data_h);
+
 /*
  * Call this function if you want to re-traverse the returned buffers
 */
 void axidma_reset_lst_traversal(sg_list *lst);
 
+/*
+ * For event loops. Start the transfer with AXIDMA_NO_WAIT, then add the fd 
+ * returned by axidma_irq_fd to your poll/epoll set (with POLLIN/EPOLLIN). When 
+ * it becomes readable, call axidma_ack_irq and then harvest your buffers.
+ * 
+ * The fd is shared by both channels, so one interrupt can mean either one 
+ * finished (or both).
+*/
+int axidma_irq_fd(axidma_ctx const *ctx);
+
+/*
+ * Never blocks. Consumes the pending interrupt (if any) so the fd stops being 
+ * readable, and re-enables the interrupt in case the UIO driver masked it. 
+ * Returns the number of interrupts since the last call, or -1 on error
+*/
+int axidma_ack_irq(axidma_ctx *ctx);
+
+/*
+ * Never blocks. Fills out[] with up to max buffers that the hardware has 
+ * finished, and returns how many it found. Unlike the dequeue functions, 
+ * these stop at the first packet that isn't done yet instead of returning it
+ * with TRANSFER_FAILED, so you can call them as often as you like. Returns -1
+ * on error
+*/
+int axidma_s2mm_harvest(axidma_ctx *ctx, s2mm_buf *out, int max);
+int axidma_mm2s_harvest(axidma_ctx *ctx, mm2s_buf *out, int max);
+
 #undef physlist
 #undef handle
 
@@ -1,12 +1,40 @@
 #ifndef PINNER_H
 #define PINNER_H 1
 
-//Max number of pages in a single pinning
-#define PINNER_MAX_PAGES 1024
+#include <linux/ioctl.h> //For _IOWR (works in the kernel and in userspace)
+
+//Max number of pages in a single pinning. Buffer sizes are unsigned, so with
+//4 KiB pages this is as big as a pinning can get anyway
+#define PINNER_MAX_PAGES (1 << 20)
 
 #define PINNER_PIN 1
 #define PINNER_UNPIN 2
 #define PINNER_FLUSH 3
+#define PINNER_SYNC_RANGE 4
+#define PINNER_ALLOC 5
+#define PINNER_PENDING 6
+
+//Flags for PINNER_SYNC_RANGE
+#define PINNER_SYNC_FOR_CPU     0x1 //Before the CPU reads what the device wrote
+#define PINNER_SYNC_FOR_DEVICE  0x2 //Before the device reads what the CPU wrote
+
+//Flags for PINNER_PIN: which way the data will go. Syncs only do the cache 
+//maintenance that direction needs, so pick the narrowest one that works
+#define PINNER_DIR_MASK             0x30
+#define PINNER_DIR_BIDIRECTIONAL    0x00 //Default
+#define PINNER_DIR_TO_DEVICE        0x10 //Device only reads it (e.g. MM2S source). Can be read-only memory
+#define PINNER_DIR_FROM_DEVICE      0x20 //Device only writes it (e.g. S2MM destination)
+
+//Flags for PINNER_ALLOC. The default is uncached memory
+#define PINNER_ALLOC_WC 0x100 //Write-combined: CPU writes are faster, still no cache maintenance
+#define PINNER_ALLOC_CONTIG 0x200 //Physically contiguous (from CMA)
+
+//Flags for PINNER_PENDING
+#define PINNER_PENDING_WAIT 0x400 //Sleep until all of this process's unpins are done
+
+//After a PINNER_ALLOC, mmap the pinner's fd at this offset (in pages) to get 
+//the memory. In bytes, that's pin_magic * the page size
+#define PINNER_MMAP_PGOFF(h) ((unsigned long)(h).pin_magic)
 
 //Normally I would want this to be an opaque struct, but there's no easy way to
 //do that when kernel and userspace share a header
@@ -20,18 +48,52 @@ struct pinner_physlist_entry {
     unsigned long addr;
     unsigned len;
 };
+//The caller decides how big this is. Set max_entries to the number of entries
+//there's room for. If that isn't enough, PINNER_PIN fails with ENOSPC and sets 
+//num_entries to how many are needed
 struct pinner_physlist {
     unsigned num_entries;
-    struct pinner_physlist_entry entries[PINNER_MAX_PAGES];
+    unsigned max_entries;
+    struct pinner_physlist_entry entries[];
 };
 
+//Bytes needed for a physlist with room for n entries
+#define PINNER_PHYSLIST_SIZE(n) (sizeof(struct pinner_physlist) + (n) * sizeof(struct pinner_physlist_entry))
+
+//The most entries a buffer of sz bytes could need (one per page it touches).
+//This counts 4 KiB pages, the smallest size Linux uses. With bigger pages 
+//(e.g. 16K or 64K on some arm64 kernels) a buffer touches fewer of them, so 
+//this is still big enough, just not as tight. Usually it's a lot less anyway,
+//since contiguous pages share an entry
+#define PINNER_PHYSLIST_WORST_CASE(sz) (((sz) + 4095) / 4096 + 1)
+
 struct pinner_cmd {
     unsigned cmd;
     void *usr_buf;
     unsigned usr_buf_sz;
     struct pinner_handle *handle; //Not sure if this is how I want to do it
     struct pinner_physlist *physlist;
+    unsigned flags; //For PINNER_SYNC_RANGE, PINNER_PIN, and PINNER_ALLOC
+};
+
+//Runs a whole array of commands with one system call:
+//  ioctl(fd, PINNER_IOC_BATCH, &batch)
+//returns how many commands were run (or -1 with errno set)
+struct pinner_batch {
+    struct pinner_cmd *cmds;
+    int *results; //results[i] is 0 or a negative errno for cmds[i]. Can be NULL
+    unsigned num_cmds; //At most PINNER_MAX_BATCH
+    unsigned flags;
 };
 
+//Flags for pinner_batch
+#define PINNER_BATCH_STOP_ON_ERROR 0x1 //Don't run anything after a failed command
+
+#define PINNER_MAX_BATCH 1024
+
+#define PINNER_IOC_MAGIC 'p'
+//The driver writes the results back, so this goes both ways
+#define PINNER_IOC_BATCH _IOWR(PINNER_IOC_MAGIC, 1, struct pinner_batch)
+
 
 #endif
@@ -7,15 +7,121 @@
 int pinner_open();
 void pinner_close(int fd);
 
+//Helper function to allocate a physlist with room for max_entries entries. 
+//Free it with free(). Returns NULL on error
+struct pinner_physlist *physlist_new(unsigned max_entries);
+
 //Helper function to pin a buffer in RAM and get the returned handle and
-//physlist object. Returns -1 on error
+//physlist object. p->max_entries has to be big enough (see 
+//PINNER_PHYSLIST_WORST_CASE), or this fails with errno set to ENOSPC and 
+//p->num_entries set to how many entries are needed. Returns -1 on error
 int pin_buf(int fd, void *buf, unsigned buf_sz, struct pinner_handle *h, struct pinner_physlist *p);
 
+//Same as pin_buf, but dir is one of the PINNER_DIR_* constants from pinner.h.
+//Use PINNER_DIR_TO_DEVICE for MM2S sources and PINNER_DIR_FROM_DEVICE for S2MM
+//destinations so that syncs only do half the cache work. Returns -1 on error
+int pin_buf_dir(int fd, void *buf, unsigned buf_sz, unsigned dir, struct pinner_handle *h, struct pinner_physlist *p);
+
+//Same as pin_buf_dir, but allocates a physlist that's just big enough and 
+//puts it in *p (free it with free()). Use this for big buffers, where the 
+//worst case would be huge. Returns -1 on error
+int pin_buf_autosize(int fd, void *buf, unsigned buf_sz, unsigned dir, struct pinner_handle *h, struct pinner_physlist **p);
+
 //Helper function to flush the cache on a pinned buffer. Returns -1 on error
 int flush_buf_cache(int fd, struct pinner_handle *h);
 
-//Helper function to unpin a buffer. Returns -1 on error
+//Helper function to sync part of a pinned buffer, from start to start+len.
+//flags is PINNER_SYNC_FOR_CPU (before reading what the device wrote) and/or 
+//PINNER_SYNC_FOR_DEVICE (before the device reads what you wrote). Much cheaper
+//than flush_buf_cache for small ranges. Returns -1 on error
+int sync_buf_range(int fd, struct pinner_handle *h, void const *start, unsigned len, unsigned flags);
+
+//Helper function to unpin a buffer. It returns right away: the pages are 
+//actually released in the background (see unpin_pending). Returns -1 on error
 int unpin_buf(int fd, struct pinner_handle *h);
 
+//Helper function to find out how many of this process's unpins are still 
+//being done in the background. If wait is nonzero, sleeps until they're all 
+//done (so it returns 0). Returns -1 on error
+int unpin_pending(int fd, int wait);
+
+//Helper function to run an array of commands (fill them in the same way you 
+//would for write()) with one system call per PINNER_MAX_BATCH commands. If 
+//results isn't NULL, results[i] gets 0 or a negative errno for cmds[i]. flags 
+//can be PINNER_BATCH_STOP_ON_ERROR. Returns how many commands were run, or -1
+//on error
+int pinner_batch(int fd, struct pinner_cmd *cmds, int *results, unsigned num_cmds, unsigned flags);
+
+//Fill in one command for pinner_batch. The arguments mean the same thing as 
+//in pin_buf_dir, sync_buf_range, and unpin_buf
+void pin_cmd(struct pinner_cmd *cmd, void *buf, unsigned buf_sz, unsigned dir, struct pinner_handle *h, struct pinner_physlist *p);
+void sync_range_cmd(struct pinner_cmd *cmd, struct pinner_handle *h, void const *start, unsigned len, unsigned flags);
+void unpin_cmd(struct pinner_cmd *cmd, struct pinner_handle *h);
+
+//Flags for alloc_pinned_buf. They are tried from biggest to smallest page size,
+//and if none of them work (or you pass 0) you get normal pages
+#define PINNED_BUF_HUGE_1G  0x1 //hugetlbfs 1 GiB pages
+#define PINNED_BUF_HUGE_2M  0x2 //hugetlbfs 2 MiB pages
+#define PINNED_BUF_THP      0x4 //Transparent huge pages (2 MiB-aligned, with madvise)
+#define PINNED_BUF_COHERENT 0x8 //Set by alloc_coherent_buf (you can't pass it to alloc_pinned_buf)
+
+//A pinned buffer allocated by alloc_pinned_buf. Pass buf and plist to 
+//axidma_list_new and h to the flushing functions. Don't modify anything!
+struct pinned_buf {
+    void *buf;
+    unsigned sz;    //Size you asked for
+    size_t map_sz;  //Size of the mapping, rounded up to the page size used
+    int flags;      //Which of the PINNED_BUF_* flags was used (0 for normal pages)
+    struct pinner_handle h;
+    struct pinner_physlist *plist;
+};
+
+//Helper function to allocate a buffer backed by huge pages (if possible) and
+//pin it. Since huge pages are physically contiguous, the physlist will have 
+//very few entries. Returns -1 on error
+int alloc_pinned_buf(int fd, unsigned sz, int flags, struct pinned_buf *b);
+
+//Helper function to allocate sz bytes of DMA-coherent memory from the pinner 
+//and mmap it. It is never cached, so flush_buf_cache and sync_buf_range aren't
+//needed (they do nothing on it). The physlist has a single entry. flags is 0 
+//for uncached memory or PINNER_ALLOC_WC for write-combined. Returns -1 on error
+int alloc_coherent_buf(int fd, unsigned sz, unsigned flags, struct pinned_buf *b);
+
+//Helper function to unpin and free a buffer from alloc_pinned_buf or 
+//alloc_coherent_buf
+void free_pinned_buf(int fd, struct pinned_buf *b);
+
+//A registration cache, so that pinning the same buffer over and over only 
+//costs a lookup. Buffers stay pinned after pin_cache_put, and a later 
+//pin_cache_get for the same range (or any range inside it) reuses the 
+//pinning. When more than max_unused pinnings are unused, the least recently 
+//used ones are unpinned.
+//
+//The cache can't tell when memory is freed, so you MUST call 
+//pin_cache_invalidate before you free() or munmap() a buffer that was in it.
+//Otherwise a new buffer at the same address would get the old physical pages
+struct pin_cache;
+
+//Returns NULL on error
+struct pin_cache *pin_cache_new(int fd, unsigned max_unused);
+
+//Unpins everything in the cache and frees it. Don't call it while there are 
+//still handles in use
+void pin_cache_free(struct pin_cache *c);
+
+//Same as pin_buf_autosize, but reuses a cached pinning if one covers the whole
+//range with a compatible direction. Hand *h and *p back to pin_cache_put 
+//instead of unpinning/freeing them. Returns -1 on error
+int pin_cache_get(struct pin_cache *c, void *buf, unsigned buf_sz, unsigned dir, struct pinner_handle *h, struct pinner_physlist **p);
+
+//Done with a handle and physlist from pin_cache_get. The buffer stays pinned 
+//until it gets evicted or invalidated
+void pin_cache_put(struct pin_cache *c, struct pinner_handle *h, struct pinner_physlist *p);
+
+//Unpins every unused pinning that overlaps buf to buf+buf_sz. Call this 
+//before freeing memory that went through the cache. Returns -1 (with errno 
+//set to EBUSY) if some of them are still in use
+int pin_cache_invalidate(struct pin_cache *c, void const *buf, unsigned buf_sz);
+
 
 #endif
@@ -170,6 +170,8 @@ int main(int argc, char **argv) {
     int fd = -1;
     int axidma_fd = -1;
     void *axidma_base = MAP_FAILED;
+    physlist *sg_plist = NULL;
+    physlist *buf_plist = NULL;
     
     //Check if arguments make sense
     if (argc != 2) {
@@ -218,25 +220,35 @@ int main(int argc, char **argv) {
     //Now we'll pin the scatter-gather list buffer. We declare the structs that
     //the driver will fill in:
     handle sg_handle;
-    physlist sg_plist;
+    sg_plist = malloc(PINNER_PHYSLIST_SIZE(PINNER_PHYSLIST_WORST_CASE(SG_LIST_SIZE)));
+    if (!sg_plist) {
+        perror("Could not allocate physlist");
+        goto cleanup;
+    }
+    sg_plist->max_entries = PINNER_PHYSLIST_WORST_CASE(SG_LIST_SIZE);
     
     //And now we actually perform the pinning
     puts("Pinning SG entry buffer...");
-    if (pin_buf(fd, sg_list, SG_LIST_SIZE, &sg_handle, &sg_plist) < 0) {
+    if (pin_buf(fd, sg_list, SG_LIST_SIZE, &sg_handle, sg_plist) < 0) {
         goto cleanup;
     }
     
     //Same thing, but for the data buffer
     handle buf_handle;
-    physlist buf_plist;
+    buf_plist = malloc(PINNER_PHYSLIST_SIZE(PINNER_PHYSLIST_WORST_CASE(BUF_SIZE)));
+    if (!buf_plist) {
+        perror("Could not allocate physlist");
+        goto cleanup;
+    }
+    buf_plist->max_entries = PINNER_PHYSLIST_WORST_CASE(BUF_SIZE);
     
     puts("Pïnning data buffer...");
-    if (pin_buf(fd, buf, BUF_SIZE, &buf_handle, &buf_plist) < 0) {
+    if (pin_buf(fd, buf, BUF_SIZE, &buf_handle, buf_plist) < 0) {
         goto cleanup;
     }
     
     //Fill in the scatter-gather entries
-    write_physlist_sg(sg_list, &sg_plist, &buf_plist);
+    write_physlist_sg(sg_list, sg_plist, buf_plist);
     
     //Flush cache
     flush_buf_cache(fd, &sg_handle);
@@ -245,13 +257,13 @@ int main(int argc, char **argv) {
     //This follows the programming sequence in the product guide. First, we 
     //write the pointer to the first descriptor
     volatile axidma_regs *regs = (volatile axidma_regs *) axidma_base;
-    unsigned long curdesc_phys = virt_to_phys(sg_list, sg_list, &sg_plist);
+    unsigned long curdesc_phys = virt_to_phys(sg_list, sg_list, sg_plist);
     regs->S2MM_curdesc_lsb = (uint32_t) (curdesc_phys & 0xFFFFFFFF);
     regs->S2MM_curdesc_msb = (uint32_t) ((curdesc_phys>>32) & 0xFFFFFFFF);
     //Enable IOC interrupts, and set run/stop to 1
     regs->S2MM_DMACR = 0b1000000000001; 
     //Now write the pointer to the last descriptor. This starts the transfer
-    unsigned long taildesc_phys = virt_to_phys(((void*)sg_list) + 128*(latencies_plist.num_entries-1), sg_list, &sg_plist);
+    unsigned long taildesc_phys = virt_to_phys(((void*)sg_list) + 128*(latencies_plist.num_entries-1), sg_list, sg_plist);
     regs->S2MM_taildesc_lsb = (uint32_t) (taildesc_phys & 0xFFFFFFFF);
     regs->S2MM_taildesc_msb = (uint32_t) ((taildesc_phys>>32) & 0xFFFFFFFF);
     
@@ -286,6 +298,8 @@ int main(int argc, char **argv) {
     
     if (latencies_buf) free(latencies_buf);
     if (sg_list) free(sg_list);
+    if (sg_plist) free(sg_plist);
+    if (buf_plist) free(buf_plist);
     if (axidma_base != MAP_FAILED) munmap(axidma_base, AXI_DMA_SPAN);
     if (axidma_fd != -1) close(axidma_fd);
     if (fd != -1) close(fd);
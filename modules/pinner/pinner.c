@@ -5,14 +5,22 @@
 #include <linux/uaccess.h> //For copy_to_user and copy_from_user
 #include <linux/mutex.h> //For mutexes
 #include <asm/page.h> //For PAGE_SHIFT
-#include <linux/mm.h> //For find_vma
+#include <linux/mm.h> //For find_vma, kvmalloc
 #include <linux/random.h> //For get_random_bytes
 #include <linux/list.h> //For linked lists
+#include <linux/hashtable.h> //For the pinning hashtable
+#include <linux/rculist.h> //For hash_add_rcu and friends
+#include <linux/kref.h> //For kref_get_unless_zero
 #include <linux/slab.h> //For kzalloc, kfree
+#include <linux/sched.h> //For cond_resched
 #include <linux/stddef.h> //For offsetof
 #include <linux/scatterlist.h> //For scatterlist struct
 #include <linux/dma-mapping.h> //For dma_map_X
 #include <asm/cacheflush.h> //For flush_cache_range
+#include <linux/of_device.h> //For of_dma_configure
+#include <linux/version.h> //For LINUX_VERSION_CODE
+#include <linux/workqueue.h> //For alloc_ordered_workqueue
+#include <linux/wait.h> //For wait_event_interruptible
 #include "pinner.h" //Custom data types and defines shared with userspace
 #include "pinner_private.h" //Private custom data types and macros
 
@@ -22,60 +30,191 @@ static LIST_HEAD(users);
 //Forward-declare miscdev struct
 static struct miscdevice pinner_miscdev;
 
-//This function only used in error-handling code
-static void put_page_list(struct page **p, int num_pages) {
+//Unpinning a big buffer takes a long time, so it's done here instead of in the
+//unpin (or close) call. It's ordered, so things are freed in the order they 
+//were queued
+static struct workqueue_struct *pinner_wq;
+
+//The misc device has to be registered before we can set up its DMA, which 
+//means someone could open it in between. pinner_open refuses until this is set
+static int dma_ready = 0;
+
+//This is the counterpart to get_user_pages_fast. If the device might have 
+//written to the pages, mark them dirty so the data isn't lost
+static void put_page_list(struct page **p, int num_pages, int dirty) {
     int i;
     for (i = 0; i < num_pages; i++) {
+        if (dirty) set_page_dirty_lock(p[i]);
         put_page(p[i]);
+        //Big pinnings can have hundreds of thousands of pages
+        if ((i & (PINNER_GUP_CHUNK - 1)) == PINNER_GUP_CHUNK - 1) cond_resched();
     }
 }
 
-static void pinner_put_sglist_pages(struct scatterlist *sglist, int num_entries) {
-    int i;
-    
-    if(!sglist) {
-        //sglist can be NULL in error-handling paths.
-        //Gracefully ignore this function call. 
-        return;
+//get_user_pages_fast, a chunk at a time so that pinning a few gigabytes 
+//doesn't hog the CPU. Returns how many pages were pinned
+static int pinner_gup(unsigned long start, int num_pages, int write, struct page **p) {
+    int done = 0;
+    while (done < num_pages) {
+        int chunk = min(num_pages - done, PINNER_GUP_CHUNK);
+        int n = get_user_pages_fast(start + ((unsigned long) done << PAGE_SHIFT), chunk, write, p + done);
+        if (n <= 0) break;
+        done += n;
+        cond_resched();
     }
-    
-    //This is the counterpart to get_user_pages_fast
-    for (i = 0; i < num_entries; i++) {
-        put_page(sg_page(&(sglist[i])));
+    return done;
+}
+
+//Converts the PINNER_DIR_* bits of a pin command's flags
+static int pinner_get_dir(unsigned flags, enum dma_data_direction *dir) {
+    switch (flags & PINNER_DIR_MASK) {
+        case PINNER_DIR_BIDIRECTIONAL:
+            *dir = DMA_BIDIRECTIONAL;
+            return 0;
+        case PINNER_DIR_TO_DEVICE:
+            *dir = DMA_TO_DEVICE;
+            return 0;
+        case PINNER_DIR_FROM_DEVICE:
+            *dir = DMA_FROM_DEVICE;
+            return 0;
+        default:
+            return -EINVAL;
     }
 }
 
+//Undoes everything a pinning did. This is only called once nobody can find
+//the pinning anymore (or it was never added to the hashtable)
 static void pinner_free_pinning(struct pinning *p) {
+    //Memory from PINNER_ALLOC goes back to the DMA allocator
+    if (p->cpu_addr) {
+        dma_free_attrs(pinner_miscdev.this_device, p->alloc_sz, p->cpu_addr, p->dma_handle, p->attrs);
+    }
+    
     //Unmap the scatterlist
-    //TODO: allow user to set direction
-    dma_unmap_sg(pinner_miscdev.this_device, p->sglist, p->num_sg_ents, DMA_BIDIRECTIONAL);
+    //Error paths can get here before (or without) dma_map_sg. Unmapping 
+    //something that was never mapped would invalidate the user's cache lines
+    if (p->mapped) {
+        dma_unmap_sg(pinner_miscdev.this_device, p->sglist, p->num_sg_ents, p->dir);
+    }
     
     //Put pages
-    pinner_put_sglist_pages(p->sglist, p->num_sg_ents);
+    if (p->pages) {
+        put_page_list(p->pages, p->num_pages, p->dir != DMA_TO_DEVICE);
+        kvfree(p->pages);
+    }
     
     //Free scatterlist
-    kfree(p->sglist);
+    kvfree(p->sglist);
+    
+    //Free pinning struct. An RCU lookup might still be looking at its magic
+    kfree_rcu(p, rcu);
+}
+
+//Runs on pinner_wq, so that whoever dropped the last reference doesn't have 
+//to wait for all the pages to be put
+static void pinner_free_work(struct work_struct *work) {
+    struct pinning *p = container_of(work, struct pinning, free_work);
+    struct proc_info *info = p->info;
+    
+    pinner_free_pinning(p);
     
-    //Remove pinning from list
-    list_del(&(p->list));
+    atomic_dec(&(info->pending));
+    wake_up(&(info->pending_wq));
+}
+
+static void pinner_release_pinning(struct kref *ref) {
+    struct pinning *p = container_of(ref, struct pinning, ref);
+    
+    //Only pinnings that made it into the hashtable get here, so p->info is set
+    atomic_inc(&(p->info->pending));
+    INIT_WORK(&(p->free_work), pinner_free_work);
+    queue_work(pinner_wq, &(p->free_work));
+}
+
+//Drops a reference to a pinning. The last one queues it to be freed. Don't 
+//call this from inside an RCU read section
+static void pinner_put(struct pinning *p) {
+    kref_put(&(p->ref), pinner_release_pinning);
+}
+
+//Finds the pinning with the given pin_magic. Returns NULL if there isn't one.
+//Call this with rcu_read_lock or info->lock held
+static struct pinning *pinner_lookup(struct proc_info *info, unsigned pin_magic) {
+    struct pinning *p;
+    
+    hash_for_each_possible_rcu(info->pinnings, p, node, pin_magic) {
+        if (p->magic == pin_magic) {
+            return p;
+        }
+    }
+    
+    return NULL;
+}
+
+//Like pinner_lookup, but doesn't need any locks held, and returns the pinning
+//with an extra reference (so it can't be freed while you use it). Call 
+//pinner_put when you're done
+static struct pinning *pinner_get(struct proc_info *info, unsigned pin_magic) {
+    struct pinning *p;
+    
+    rcu_read_lock();
+    p = pinner_lookup(info, pin_magic);
+    //If this fails, someone is in the middle of unpinning it
+    if (p && !kref_get_unless_zero(&(p->ref))) p = NULL;
+    rcu_read_unlock();
     
-    //Free pinning struct
-    kfree(p);
+    return p;
+}
+
+//Gives a pinning a fresh magic number and makes it visible to lookups. The 
+//hashtable owns the reference the pinning was created with
+static void pinner_insert(struct proc_info *info, struct pinning *p) {
+    p->info = info;
+    mutex_lock(&(info->lock));
+    //The magic is also the mmap offset for PINNER_ALLOC, so it can't collide 
+    //with another one
+    do {
+        get_random_bytes(&(p->magic), sizeof(p->magic));
+    } while (pinner_lookup(info, p->magic));
+    hash_add_rcu(info->pinnings, &(p->node), p->magic);
+    mutex_unlock(&(info->lock));
+}
+
+//Takes a pinning out of the hashtable and drops the hashtable's reference
+static void pinner_remove(struct proc_info *info, struct pinning *p) {
+    mutex_lock(&(info->lock));
+    hash_del_rcu(&(p->node));
+    mutex_unlock(&(info->lock));
+    pinner_put(p);
 }
 
 static void pinner_free_pinnings(struct proc_info *info) {
     //printk(KERN_ALERT "Entered pinner_free_pinnings\n");
-    //Iterate through the list of pinnings inside this proc_info struct
-    //and free them all
-    while (!list_empty(&(info->pinning_list))) {
-        struct pinning *p = list_entry(info->pinning_list.next, struct pinning, list);
-        pinner_free_pinning(p);
+    //Iterate through the hashtable inside this proc_info struct and free all 
+    //the pinnings. The file is being closed, so nobody else can be using them
+    struct pinning *p;
+    struct hlist_node *tmp;
+    int bkt;
+    
+    mutex_lock(&(info->lock));
+    hash_for_each_safe(info->pinnings, bkt, tmp, p, node) {
+        hash_del_rcu(&(p->node));
+        pinner_put(p);
     }
+    mutex_unlock(&(info->lock));
+}
+
+static void pinner_free_proc_info_work(struct work_struct *work) {
+    struct proc_info *info = container_of(work, struct proc_info, free_work);
+    
+    //Free the struct itself
+    mutex_destroy(&(info->lock));
+    kfree(info);
 }
 
 static void pinner_free_proc_info(struct proc_info *info) {
     //printk(KERN_ALERT "Entered pinner_free_proc_info\n");
-    //Free all the pinnings stored in this proc_info struct
+    //Queue up all the pinnings stored in this proc_info struct to be freed
     pinner_free_pinnings(info);
     
     //Remove from the list
@@ -83,8 +222,10 @@ static void pinner_free_proc_info(struct proc_info *info) {
     list_del(&(info->list));
     mutex_unlock(&users_mutex);
     
-    //Free the struct itself
-    kfree(info);
+    //The pinnings still point at info to update its pending count. pinner_wq
+    //is ordered, so queueing this after them means it runs after they're done
+    INIT_WORK(&(info->free_work), pinner_free_proc_info_work);
+    queue_work(pinner_wq, &(info->free_work));
 }
 
 static int pinner_send_physlist(struct pinner_cmd *cmd, struct pinning *p) {
@@ -97,29 +238,30 @@ static int pinner_send_physlist(struct pinner_cmd *cmd, struct pinning *p) {
     void *user_entries = ((void *)cmd->physlist) + offsetof(struct pinner_physlist, entries);
     
     //Allocate space for the entries we'll copy to user space
-    entries = kzalloc(p->num_sg_ents * (sizeof(struct pinner_physlist_entry)), GFP_KERNEL);
+    entries = kvmalloc(p->num_dma_ents * (sizeof(struct pinner_physlist_entry)), GFP_KERNEL);
     if (!entries) {
-        printk(KERN_ALERT "pinner: could not allocate buffer of size [%lu]\n", p->num_sg_ents * (sizeof(struct pinner_physlist_entry)));
+        printk(KERN_ALERT "pinner: could not allocate buffer of size [%lu]\n", p->num_dma_ents * (sizeof(struct pinner_physlist_entry)));
         ret = -ENOMEM;
         goto send_physlist_cleanup;
     }
     
     //Walk through the struct scatterlist array in the pinning and write the
-    //information into the struct_physlist_entries
-    for (i = 0; i < p->num_sg_ents; i++) {
-        entries[i].addr = p->sglist[i].dma_address + p->sglist[i].offset;
-        entries[i].len = p->sglist[i].length;
+    //information into the struct_physlist_entries. dma_map_sg already added 
+    //the offset into the first page
+    for (i = 0; i < p->num_dma_ents; i++) {
+        entries[i].addr = sg_dma_address(&(p->sglist[i]));
+        entries[i].len = sg_dma_len(&(p->sglist[i]));
     }
     
     //Write the num_entries field of the user's pinner_physlist
-    n = copy_to_user(user_num_entries, &(p->num_sg_ents), sizeof(unsigned));
+    n = copy_to_user(user_num_entries, &(p->num_dma_ents), sizeof(unsigned));
     if (n != 0) {
         printk(KERN_ALERT "pinner: could not copy num_entries to userspace\n");
         ret = -EAGAIN;
         goto send_physlist_cleanup;
     }
     //Write the entries themselves
-    n = copy_to_user(user_entries, entries, p->num_sg_ents * (sizeof(struct pinner_physlist_entry)));
+    n = copy_to_user(user_entries, entries, p->num_dma_ents * (sizeof(struct pinner_physlist_entry)));
     if (n  != 0) {
         printk(KERN_ALERT "pinner: could not copy entries to userspace\n");
         ret = -EAGAIN;
@@ -127,15 +269,48 @@ static int pinner_send_physlist(struct pinner_cmd *cmd, struct pinning *p) {
     }
     
     send_physlist_cleanup:
-    if (entries) kfree(entries);
+    if (entries) kvfree(entries);
     return ret;
 }
 
+//Makes sure the user's physlist has room for needed entries. If it doesn't, 
+//tells them how many it needs (in num_entries) and returns -ENOSPC
+static int pinner_check_physlist(struct pinner_cmd *cmd, unsigned needed) {
+    unsigned max_entries;
+    int n;
+    
+    n = copy_from_user(&max_entries, &(cmd->physlist->max_entries), sizeof(unsigned));
+    if (n != 0) {
+        printk(KERN_ALERT "pinner: could not copy max_entries from userspace\n");
+        return -EFAULT;
+    }
+    if (needed <= max_entries) return 0;
+    
+    n = copy_to_user(&(cmd->physlist->num_entries), &needed, sizeof(unsigned));
+    if (n != 0) {
+        printk(KERN_ALERT "pinner: could not copy num_entries to userspace\n");
+        return -EFAULT;
+    }
+    return -ENOSPC;
+}
+
+//Returns nonzero if page b comes right after page a in physical memory
+static inline int pages_contiguous(struct page *a, struct page *b) {
+    return page_to_phys(a) + PAGE_SIZE == page_to_phys(b);
+}
+
+//Builds the scatterlist for a pinning. Runs of physically contiguous pages are
+//merged into a single scatterlist entry, which also means the pieces of a 
+//compound (huge) page show up as one entry. Sets p->num_sg_ents.
 static int pinner_alloc_and_fill_sglist(struct page **page_arr, int num_pages, 
             struct pinning *p, unsigned long first_page_offset, unsigned total_sz) 
 {
     int i;
-    unsigned first_page_sz;
+    int num_runs;
+    int run;
+    int run_start;
+    unsigned run_len;
+    unsigned offset;
     
     //Make sure inputs are valid
     if (!page_arr || num_pages <= 0 || !p) {
@@ -143,38 +318,47 @@ static int pinner_alloc_and_fill_sglist(struct page **page_arr, int num_pages,
         return -EINVAL;
     }
     
+    //First pass: count the runs of contiguous pages
+    num_runs = 1;
+    for (i = 1; i < num_pages; i++) {
+        if (!pages_contiguous(page_arr[i-1], page_arr[i])) num_runs++;
+    }
+    
     //Allocate an array of struct scatterlists in the pinning
-    p->sglist = kzalloc(num_pages * (sizeof(struct scatterlist)), GFP_KERNEL);
+    p->sglist = kvzalloc(num_runs * (sizeof(struct scatterlist)), GFP_KERNEL);
     if (!(p->sglist)) {
-        printk(KERN_ALERT "pinner: could not allocate buffer of size [%lu]\n", num_pages * (sizeof(struct scatterlist)));
+        printk(KERN_ALERT "pinner: could not allocate buffer of size [%lu]\n", num_runs * (sizeof(struct scatterlist)));
         return -ENOMEM;
     }
+    sg_init_table(p->sglist, num_runs);
     
-    //This code is based off an answer on this stackoverflow post:
-    //https://stackoverflow.com/questions/5539375/linux-kernel-device-driver-to-dma-from-a-device-into-user-space-memory
-    //First page
-    if (total_sz < PAGE_SIZE - first_page_offset) {
-        first_page_sz = total_sz;
-    } else {
-        first_page_sz = PAGE_SIZE - first_page_offset;
-    }
-    sg_set_page(&(p->sglist[0]), page_arr[0], first_page_sz, first_page_offset);
-    p->sglist[0].dma_address = page_to_phys(page_arr[0]);
-    //Middle pages
-    for (i = 1; i < num_pages - 1; i++) {
-        sg_set_page(&(p->sglist[i]), page_arr[i], PAGE_SIZE, 0);
-        p->sglist[i].dma_address = page_to_phys(page_arr[i]);
-    }
-    //Last page
-    if (num_pages > 1) {
-        sg_set_page(
-            &(p->sglist[num_pages-1]), page_arr[num_pages-1],
-            total_sz - (PAGE_SIZE - first_page_offset) - (num_pages-2)*PAGE_SIZE,
-            0
-        );
-        p->sglist[num_pages-1].dma_address = page_to_phys(page_arr[num_pages-1]);
+    //Second pass: fill in one scatterlist entry per run. The first run starts
+    //at first_page_offset and the last one stops at total_sz
+    //(Originally based off an answer on this stackoverflow post:
+    //https://stackoverflow.com/questions/5539375/linux-kernel-device-driver-to-dma-from-a-device-into-user-space-memory)
+    run = 0;
+    run_start = 0;
+    offset = first_page_offset;
+    run_len = 0;
+    for (i = 0; i < num_pages; i++) {
+        //Number of bytes of this page that are part of the user's buffer
+        unsigned pg_len = PAGE_SIZE - ((i == 0) ? first_page_offset : 0);
+        if (pg_len > total_sz) pg_len = total_sz;
+        total_sz -= pg_len;
+        run_len += pg_len;
+        
+        //Close the run if the next page doesn't follow this one
+        if (i == num_pages - 1 || !pages_contiguous(page_arr[i], page_arr[i+1])) {
+            sg_set_page(&(p->sglist[run]), page_arr[run_start], run_len, offset);
+            run++;
+            run_start = i + 1;
+            run_len = 0;
+            offset = 0;
+        }
     }
     
+    p->num_sg_ents = num_runs;
+    
     //Success
     return 0;
 }
@@ -192,6 +376,12 @@ static int pinner_do_pin(struct pinner_cmd *cmd, struct proc_info *info) {
     struct page **p = NULL;
     
     struct pinner_handle usr_handle;
+    enum dma_data_direction dir;
+    
+    if (pinner_get_dir(cmd->flags, &dir) < 0) {
+        printk(KERN_ALERT "pinner: invalid direction flags [%x]\n", cmd->flags);
+        return -EINVAL;
+    }
     
     start = ((unsigned long)cmd->usr_buf | page_mask) - page_mask;
     first_pg_offset = (unsigned long)cmd->usr_buf - start;
@@ -210,17 +400,23 @@ static int pinner_do_pin(struct pinner_cmd *cmd, struct proc_info *info) {
         goto do_pin_error;
     }
     
-    //Attempt to pin pages 
-    p = kmalloc(num_pages * (sizeof(struct page *)), GFP_KERNEL);
+    //Attempt to pin pages. For big pinnings this array is too big for kmalloc
+    p = kvmalloc(num_pages * (sizeof(struct page *)), GFP_KERNEL);
     if (!p) {
         printk(KERN_ALERT "pinner: could not allocate buffer of size [%lu]\n", num_pages * (sizeof(struct page *)));
         ret = -ENOMEM;
         goto do_pin_error;
     }
-    n = get_user_pages_fast(start, num_pages, 1, p);
+    //If the device is only going to read the buffer, we don't need write 
+    //access, which means read-only buffers can be pinned too
+    n = pinner_gup(start, num_pages, dir != DMA_TO_DEVICE, p);
     if (n != num_pages) {
         //Could not pin all the pages. Just quit and ask the user to try again
         printk(KERN_ERR "pinner: could not satisfy user request\n");
+        //Only put back the pages we actually got
+        if (n > 0) put_page_list(p, n, 0);
+        kvfree(p);
+        p = NULL;
         ret = -EAGAIN;
         goto do_pin_error;
     }
@@ -232,25 +428,41 @@ static int pinner_do_pin(struct pinner_cmd *cmd, struct proc_info *info) {
         ret = -ENOMEM;
         goto do_pin_error;
     }
-    pin->num_sg_ents = num_pages;
-    ret = pinner_alloc_and_fill_sglist(p, num_pages, pin, first_pg_offset, cmd->usr_buf_sz);
+    kref_init(&(pin->ref));
+    //Note to self: look out for double-frees, since now these pages are managed by the pinning struct
+    pin->pages = p;
+    pin->num_pages = num_pages;
+    pin->usr_start = (unsigned long) cmd->usr_buf;
+    pin->usr_sz = cmd->usr_buf_sz;
+    pin->dir = dir;
+    p = NULL; //For extra safety against double-freeing
+    
+    //Build the scatterlist. This sets pin->num_sg_ents, which is usually a lot
+    //less than num_pages
+    ret = pinner_alloc_and_fill_sglist(pin->pages, num_pages, pin, first_pg_offset, cmd->usr_buf_sz);
+    if (ret < 0) {
+        goto do_pin_error;
+    }
+    
+    //Now that we know how many entries the physlist needs, make sure the user
+    //has room for them
+    ret = pinner_check_physlist(cmd, pin->num_sg_ents);
     if (ret < 0) {
         goto do_pin_error;
     }
-    //Note to self: look out for double-frees, since now these pages are managed by the pinning struct
-    p = NULL; //For extra safety against double-freeing
-    get_random_bytes(&(pin->magic), sizeof(pin->magic));
-    list_add(&(pin->list), &(info->pinning_list)); //CAREFUL: list_add adds the first argument to the second
     
     //Perform the DMA mapping (whatever that means)
     //Well, I know it eventually defers to some architecture-specific assmebly
     //code, so I'm guess it turns off the cache (which is what I want)
-    //TODO: allow user to set direction
-    ret = dma_map_sg(pinner_miscdev.this_device, pin->sglist, pin->num_sg_ents, DMA_BIDIRECTIONAL);
-    if (ret < 0) {
+    //dma_map_sg returns 0 if it fails
+    ret = dma_map_sg(pinner_miscdev.this_device, pin->sglist, pin->num_sg_ents, pin->dir);
+    if (ret == 0) {
         printk(KERN_ALERT "pinner: Could not perform dma_map_sg\n");
+        ret = -ENOMEM;
         goto do_pin_error;
     }
+    pin->num_dma_ents = ret;
+    pin->mapped = 1;
     
     //Write the physical address info back to userspace
     ret = pinner_send_physlist(cmd, pin);
@@ -258,14 +470,17 @@ static int pinner_do_pin(struct pinner_cmd *cmd, struct proc_info *info) {
         goto do_pin_error;
     }
     
+    //From here on, other threads can find the pinning
+    pinner_insert(info, pin);
+    
     //Give the userspace program a handle that allows them to undo this pinning
     usr_handle.user_magic = info->magic;
     usr_handle.pin_magic = pin->magic;
     n = copy_to_user(cmd->handle, &usr_handle, sizeof(struct pinner_handle));
     if (n != 0) {
         printk(KERN_ALERT "pinner: could not copy handle to userspace\n");
-        ret = -EAGAIN;
-        goto do_pin_error;
+        pinner_remove(info, pin);
+        return -EAGAIN;
     }
     
     return 0;
@@ -277,109 +492,349 @@ static int pinner_do_pin(struct pinner_cmd *cmd, struct proc_info *info) {
     } else if (p) {
         //This is in an else if, since p is inside the pinning struct and will
         //be freed in the call to pinner_free_pinning(p)
-        put_page_list(p, num_pages);
-        kfree(p);
+        put_page_list(p, num_pages, 0);
+        kvfree(p);
     }
     return ret;
 }
 
 
-static int pinner_do_flush(struct pinner_cmd *cmd, struct proc_info *info) {
-    struct list_head *cur; //For iterating
-    struct pinner_handle usr_handle;
+//Copies the user's handle in and checks that it belongs to this process. 
+//Returns -1 (and prints an error) if it doesn't
+static int pinner_get_handle(struct pinner_cmd *cmd, struct proc_info *info, char const *what, struct pinner_handle *usr_handle) {
     int n;
-    struct pinning *found = NULL;
     
     //Copy handle from userspace
-    n = copy_from_user(&usr_handle, cmd->handle, sizeof(struct pinner_handle));
+    n = copy_from_user(usr_handle, cmd->handle, sizeof(struct pinner_handle));
     if (n != 0) {
-        printk(KERN_ALERT "pinner: flush: could not copy handle from userspace\n");
-        return -EAGAIN;
+        printk(KERN_ALERT "pinner: %s: could not copy handle from userspace\n", what);
+        return -1;
     }
     
     //Ensure that the user's handle matches the correct user_magic. We want to
     //make it very difficult for buggy (or malicious) user code to accidentally
     //unpin someone else's pinnings
-    if (usr_handle.user_magic != info->magic) {
-        printk(KERN_ALERT "pinner: incorrect user handle. No unpinning was performed\n");
-        return -EINVAL;
+    if (usr_handle->user_magic != info->magic) {
+        printk(KERN_ALERT "pinner: %s: incorrect user handle\n", what);
+        return -1;
     }
     
-    //Search linearly through pinning structs for correct pin_magic
-    //Note: who cares if this is inefficient? It's not like this function is
-    //getting called millions of times per second
-    for (cur = info->pinning_list.next; cur != &(info->pinning_list); cur = cur->next) {
-        struct pinning *p = list_entry(cur, struct pinning, list);
-        if (usr_handle.pin_magic == p->magic) {
-            found = p;
-            break;
-        }
+    return 0;
+}
+
+//Finds the pinning that the user's handle refers to. Returns NULL (and prints
+//an error) if there isn't one. Otherwise, call pinner_put when you're done
+static struct pinning *pinner_find_pinning(struct pinner_cmd *cmd, struct proc_info *info, char const *what) {
+    struct pinning *p;
+    struct pinner_handle usr_handle;
+    
+    if (pinner_get_handle(cmd, info, what, &usr_handle) < 0) return NULL;
+    
+    p = pinner_get(info, usr_handle.pin_magic);
+    if (!p) {
+        printk(KERN_ALERT "pinner: %s: incorrect pin handle\n", what);
     }
+    return p;
+}
+
+static int pinner_do_flush(struct pinner_cmd *cmd, struct proc_info *info) {
+    struct pinning *found = pinner_find_pinning(cmd, info, "flush");
+    if (!found) return -EINVAL;
     
-    if (!found) {
-        printk(KERN_ALERT "pinner: incorrect pin handle. No unpinning was performed\n");
-        return -EINVAL;
+    //Coherent memory never needs flushing
+    if (found->cpu_addr) {
+        pinner_put(found);
+        return 0;
     }
     
     //Perform the cache flushing (I hope this works!)
-    //TODO: allow user to set direction
+    //The direction the buffer was pinned with decides whether this cleans,
+    //invalidates, or both
     if ((cmd->usr_buf_sz & 1) == 0) {
         printk(KERN_INFO "pinner: performing dma_sync_sg_for_cpu");
-        dma_sync_sg_for_cpu(pinner_miscdev.this_device, found->sglist, found->num_sg_ents, DMA_BIDIRECTIONAL);
+        dma_sync_sg_for_cpu(pinner_miscdev.this_device, found->sglist, found->num_sg_ents, found->dir);
     }
     if ((cmd->usr_buf_sz & 0b10) == 0) {
         printk(KERN_INFO "pinner: performing dma_sync_sg_for_device");
-        dma_sync_sg_for_device(pinner_miscdev.this_device, found->sglist, found->num_sg_ents, DMA_BIDIRECTIONAL);
+        dma_sync_sg_for_device(pinner_miscdev.this_device, found->sglist, found->num_sg_ents, found->dir);
     }
+    
+    pinner_put(found);
     return 0;
 }
 
+//Like pinner_do_flush, but only syncs the bytes from usr_buf to 
+//usr_buf + usr_buf_sz, which have to be inside the pinning. The scatterlist 
+//entries that overlap the range are synced with dma_sync_single_*, so the cost 
+//depends on the size of the range instead of the size of the pinning
+static int pinner_do_sync_range(struct pinner_cmd *cmd, struct proc_info *info) {
+    struct device *dev = pinner_miscdev.this_device;
+    struct pinning *found;
+    unsigned long start;
+    unsigned long end;
+    unsigned long pos;
+    int i;
+    int ret = 0;
+    
+    if (!(cmd->flags & (PINNER_SYNC_FOR_CPU | PINNER_SYNC_FOR_DEVICE))) {
+        printk(KERN_ALERT "pinner: sync: no direction given\n");
+        return -EINVAL;
+    }
+    
+    found = pinner_find_pinning(cmd, info, "sync");
+    if (!found) return -EINVAL;
+    
+    //Coherent memory never needs syncing
+    if (found->cpu_addr) goto sync_range_done;
+    
+    //Convert the user's range into offsets from the start of the pinning
+    start = (unsigned long) cmd->usr_buf;
+    if (start < found->usr_start || cmd->usr_buf_sz > found->usr_sz 
+        || start - found->usr_start > found->usr_sz - cmd->usr_buf_sz) 
+    {
+        printk(KERN_ALERT "pinner: sync: range is outside the pinned buffer\n");
+        ret = -EINVAL;
+        goto sync_range_done;
+    }
+    start -= found->usr_start;
+    end = start + cmd->usr_buf_sz;
+    
+    //Walk the scatterlist. Entry i covers offsets pos to pos + length
+    pos = 0;
+    for (i = 0; i < found->num_dma_ents && pos < end; i++) {
+        struct scatterlist *sg = &(found->sglist[i]);
+        unsigned long ent_end = pos + sg_dma_len(sg);
+        
+        if (ent_end > start) {
+            unsigned long from = (start > pos) ? start : pos;
+            unsigned long to = (end < ent_end) ? end : ent_end;
+            dma_addr_t addr = sg_dma_address(sg) + (from - pos);
+            
+            if (cmd->flags & PINNER_SYNC_FOR_CPU) {
+                dma_sync_single_for_cpu(dev, addr, to - from, found->dir);
+            }
+            if (cmd->flags & PINNER_SYNC_FOR_DEVICE) {
+                dma_sync_single_for_device(dev, addr, to - from, found->dir);
+            }
+        }
+        
+        pos = ent_end;
+    }
+    
+    sync_range_done:
+    pinner_put(found);
+    return ret;
+}
+
 static int pinner_do_unpin(struct pinner_cmd *cmd, struct proc_info *info) {
-    struct list_head *cur; //For iterating
     struct pinner_handle usr_handle;
-    int n;
-    struct pinning *found = NULL;
+    struct pinning *found;
     
-    //Copy handle from userspace
-    n = copy_from_user(&usr_handle, cmd->handle, sizeof(struct pinner_handle));
-    if (n != 0) {
-        printk(KERN_ALERT "pinner: could not copy handle from userspace\n");
-        return -EAGAIN;
+    if (pinner_get_handle(cmd, info, "unpin", &usr_handle) < 0) return -EINVAL;
+    
+    //Hold the lock so that two threads can't unpin the same thing, and so 
+    //that nobody can mmap it while we're checking
+    mutex_lock(&(info->lock));
+    found = pinner_lookup(info, usr_handle.pin_magic);
+    if (!found) {
+        mutex_unlock(&(info->lock));
+        printk(KERN_ALERT "pinner: unpin: incorrect pin handle\n");
+        return -EINVAL;
     }
     
-    //Ensure that the user's handle matches the correct user_magic. We want to
-    //make it very difficult for buggy (or malicious) user code to accidentally
-    //unpin someone else's pinnings
-    if (usr_handle.user_magic != info->magic) {
-        printk(KERN_ALERT "pinner: incorrect user handle. No unpinning was performed\n");
+    //Freeing memory from PINNER_ALLOC while it's still mapped would leave the 
+    //user pointing at pages someone else could get
+    if (atomic_read(&(found->mmap_count)) > 0) {
+        mutex_unlock(&(info->lock));
+        printk(KERN_ALERT "pinner: unpin: buffer is still mmapped. Call munmap first\n");
+        return -EBUSY;
+    }
+    
+    //Delete the pinning. If another thread is still flushing it, the memory 
+    //is freed when that thread is done. Either way, the actual unpinning 
+    //happens later on pinner_wq (see PINNER_PENDING)
+    hash_del_rcu(&(found->node));
+    mutex_unlock(&(info->lock));
+    pinner_put(found);
+    
+    return 0;
+}
+
+//Tells the user how many of their unpins haven't finished yet, by writing it
+//to usr_buf (if it isn't NULL). With PINNER_PENDING_WAIT, first sleeps until 
+//there aren't any
+static int pinner_do_pending(struct pinner_cmd *cmd, struct proc_info *info) {
+    unsigned pending;
+    
+    if (cmd->flags & ~PINNER_PENDING_WAIT) {
+        printk(KERN_ALERT "pinner: pending: invalid flags [%x]\n", cmd->flags);
         return -EINVAL;
     }
     
-    //Search linearly through pinning structs for correct pin_magic
-    //Note: who cares if this is inefficient? It's not like this function is
-    //getting called millions of times per second
-    for (cur = info->pinning_list.next; cur != &(info->pinning_list); cur = cur->next) {
-        struct pinning *p = list_entry(cur, struct pinning, list);
-        if (usr_handle.pin_magic == p->magic) {
-            found = p;
-            break;
+    if (cmd->flags & PINNER_PENDING_WAIT) {
+        if (wait_event_interruptible(info->pending_wq, atomic_read(&(info->pending)) == 0)) {
+            return -ERESTARTSYS;
         }
     }
     
-    if (!found) {
-        printk(KERN_ALERT "pinner: incorrect pin handle. No unpinning was performed\n");
+    pending = atomic_read(&(info->pending));
+    if (cmd->usr_buf && copy_to_user(cmd->usr_buf, &pending, sizeof(unsigned)) != 0) {
+        printk(KERN_ALERT "pinner: pending: could not copy count to userspace\n");
+        return -EFAULT;
+    }
+    
+    return 0;
+}
+
+//Allocates DMA-coherent (or write-combined) memory for the user. Unlike 
+//PINNER_PIN, there are no user pages: the user mmaps the pinner's fd at
+//PINNER_MMAP_PGOFF(handle) to get at the memory. Since it's never cached, it 
+//never needs flushing, which makes it a good place for SG descriptors
+static int pinner_do_alloc(struct pinner_cmd *cmd, struct proc_info *info) {
+    int ret = 0;
+    int n;
+    struct device *dev = pinner_miscdev.this_device;
+    struct pinning *pin = NULL;
+    size_t sz;
+    unsigned num_entries = 1;
+    struct pinner_physlist_entry entry;
+    struct pinner_handle usr_handle;
+    
+    if (cmd->flags & ~(PINNER_ALLOC_WC | PINNER_ALLOC_CONTIG)) {
+        printk(KERN_ALERT "pinner: alloc: invalid flags [%x]\n", cmd->flags);
+        return -EINVAL;
+    }
+    
+    //Contiguous allocations come out of CMA as a single extent, so the only 
+    //limit is how big the CMA area is (the cma= kernel parameter)
+    sz = PAGE_ALIGN((size_t) cmd->usr_buf_sz);
+    if (sz == 0 || (!(cmd->flags & PINNER_ALLOC_CONTIG) && sz > PINNER_MAX_PAGES * PAGE_SIZE)) {
+        printk(KERN_ALERT "pinner: alloc: invalid size [%u]\n", cmd->usr_buf_sz);
         return -EINVAL;
     }
     
-    //Delete the pinning
-    pinner_free_pinning(found);
+    //The physlist will have exactly one entry
+    ret = pinner_check_physlist(cmd, 1);
+    if (ret < 0) return ret;
+    
+    pin = kzalloc(sizeof(struct pinning), GFP_KERNEL);
+    if (!pin) {
+        printk(KERN_ALERT "pinner: could not allocate buffer of size [%lu]\n", sizeof(struct pinning));
+        return -ENOMEM;
+    }
+    kref_init(&(pin->ref));
+    atomic_set(&(pin->mmap_count), 0);
+    pin->dir = DMA_BIDIRECTIONAL;
+    pin->alloc_sz = sz;
+    pin->attrs = (cmd->flags & PINNER_ALLOC_WC) ? DMA_ATTR_WRITE_COMBINE : 0;
+    //Without an IOMMU this is contiguous anyway, but with one we'd only get 
+    //something contiguous in the device's address space
+    if (cmd->flags & PINNER_ALLOC_CONTIG) pin->attrs |= DMA_ATTR_FORCE_CONTIGUOUS;
+    
+    pin->cpu_addr = dma_alloc_attrs(dev, sz, &(pin->dma_handle), GFP_KERNEL, pin->attrs);
+    if (!pin->cpu_addr) {
+        printk(KERN_ALERT "pinner: alloc: could not allocate [%lu] bytes of DMA memory%s\n", sz, 
+            (cmd->flags & PINNER_ALLOC_CONTIG) ? ". Is the CMA area big enough?" : "");
+        ret = -ENOMEM;
+        goto do_alloc_error;
+    }
+    
+    //The DMA address range is contiguous, so the physlist only has one entry
+    entry.addr = pin->dma_handle;
+    entry.len = cmd->usr_buf_sz;
+    n = copy_to_user(&(cmd->physlist->num_entries), &num_entries, sizeof(unsigned));
+    n += copy_to_user(&(cmd->physlist->entries[0]), &entry, sizeof(struct pinner_physlist_entry));
+    if (n != 0) {
+        printk(KERN_ALERT "pinner: alloc: could not copy physlist to userspace\n");
+        ret = -EAGAIN;
+        goto do_alloc_error;
+    }
+    
+    pinner_insert(info, pin);
+    
+    usr_handle.user_magic = info->magic;
+    usr_handle.pin_magic = pin->magic;
+    n = copy_to_user(cmd->handle, &usr_handle, sizeof(struct pinner_handle));
+    if (n != 0) {
+        printk(KERN_ALERT "pinner: alloc: could not copy handle to userspace\n");
+        pinner_remove(info, pin);
+        return -EAGAIN;
+    }
     
     return 0;
+    
+    do_alloc_error:
+    pinner_free_pinning(pin);
+    return ret;
+}
+
+//Keep track of how many mappings of an allocation exist (fork and partial 
+//munmap can add more) so that it isn't freed out from under them
+static void pinner_vma_open(struct vm_area_struct *vma) {
+    struct pinning *pin = vma->vm_private_data;
+    atomic_inc(&(pin->mmap_count));
+}
+
+static void pinner_vma_close(struct vm_area_struct *vma) {
+    struct pinning *pin = vma->vm_private_data;
+    atomic_dec(&(pin->mmap_count));
+}
+
+static const struct vm_operations_struct pinner_vm_ops = {
+    .open = pinner_vma_open,
+    .close = pinner_vma_close
+};
+
+//Maps memory from PINNER_ALLOC into userspace. The page offset selects the 
+//allocation (see PINNER_MMAP_PGOFF)
+static int pinner_mmap(struct file *filp, struct vm_area_struct *vma) {
+    int ret = 0;
+    struct proc_info *info = filp->private_data;
+    unsigned long sz = vma->vm_end - vma->vm_start;
+    struct pinning *pin;
+    
+    //Holding the lock keeps the allocation from being unpinned under us
+    mutex_lock(&(info->lock));
+    pin = pinner_lookup(info, (unsigned) vma->vm_pgoff);
+    if (!pin || !pin->cpu_addr || (unsigned long) pin->magic != vma->vm_pgoff) {
+        printk(KERN_ALERT "pinner: mmap: offset does not match any allocation\n");
+        ret = -EINVAL;
+        goto mmap_done;
+    }
+    if (sz > pin->alloc_sz) {
+        printk(KERN_ALERT "pinner: mmap: asked for [%lu] bytes, but allocation only has [%lu]\n", sz, pin->alloc_sz);
+        ret = -EINVAL;
+        goto mmap_done;
+    }
+    
+    //dma_mmap_attrs treats vm_pgoff as an offset into the buffer, but we 
+    //already used it to pick the buffer
+    vma->vm_pgoff = 0;
+    ret = dma_mmap_attrs(pinner_miscdev.this_device, vma, pin->cpu_addr, pin->dma_handle, pin->alloc_sz, pin->attrs);
+    if (ret < 0) {
+        printk(KERN_ALERT "pinner: mmap: dma_mmap_attrs failed\n");
+        goto mmap_done;
+    }
+    
+    vma->vm_private_data = pin;
+    vma->vm_ops = &pinner_vm_ops;
+    pinner_vma_open(vma);
+    
+    mmap_done:
+    mutex_unlock(&(info->lock));
+    return ret;
 }
 
 static int pinner_open (struct inode *inode, struct file *filp) {
     struct proc_info *info = NULL;
     
+    //Every command needs DMA ops and a mask, so don't let anyone in before 
+    //pinner_init has set them up
+    if (!smp_load_acquire(&dma_ready)) {
+        printk(KERN_ALERT "pinner: not ready yet\n");
+        return -EAGAIN;
+    }
+    
 	//Allocate and insert a new proc_info. Values should be initialized to zero
     info = kzalloc(sizeof(struct proc_info), GFP_KERNEL);
     if (!info) {
@@ -387,8 +842,11 @@ static int pinner_open (struct inode *inode, struct file *filp) {
         return -ENOMEM;
     }
     
-    //Initialize list of pinnings
-    INIT_LIST_HEAD(&(info->pinning_list));
+    //Initialize table of pinnings
+    hash_init(info->pinnings);
+    mutex_init(&(info->lock));
+    atomic_set(&(info->pending), 0);
+    init_waitqueue_head(&(info->pending_wq));
     
     //Initialize the magic
     get_random_bytes(&(info->magic), sizeof(info->magic));
@@ -415,6 +873,34 @@ static int pinner_release (struct inode *inode, struct file *filp) {
 	return 0;
 }
 
+//Runs one command (already copied in from userspace)
+static int pinner_do_cmd(struct pinner_cmd *cmd, struct proc_info *info) {
+    switch(cmd->cmd) {
+        case PINNER_PIN:
+            return pinner_do_pin(cmd, info);
+            break;
+        case PINNER_UNPIN:
+            return pinner_do_unpin(cmd, info);
+            break;
+        case PINNER_FLUSH: {
+            return pinner_do_flush(cmd, info);
+            break;
+        }
+        case PINNER_SYNC_RANGE:
+            return pinner_do_sync_range(cmd, info);
+            break;
+        case PINNER_ALLOC:
+            return pinner_do_alloc(cmd, info);
+            break;
+        case PINNER_PENDING:
+            return pinner_do_pending(cmd, info);
+            break;
+        default:
+            printk(KERN_ALERT "pinner: unrecognized command code [%u]\n", cmd->cmd);
+            return -ENOSYS;
+    }
+}
+
 //Write function. Handles commands from userspace
 static ssize_t pinner_write (struct file *filp, char const __user *buf, size_t sz, loff_t *off) {
     int rc;
@@ -432,30 +918,75 @@ static ssize_t pinner_write (struct file *filp, char const __user *buf, size_t s
         return -EAGAIN;
     }
     
-    switch(cmd.cmd) {
-        case PINNER_PIN:
-            return pinner_do_pin(&cmd, info);
-            break;
-        case PINNER_UNPIN:
-            return pinner_do_unpin(&cmd, info);
-            break;
-        case PINNER_FLUSH: {
-            return pinner_do_flush(&cmd, info);
+    return pinner_do_cmd(&cmd, info);
+}
+
+//Ioctl function. PINNER_IOC_BATCH runs a whole array of commands, so the user
+//only pays for one system call (and one copy_from_user)
+static long pinner_ioctl(struct file *filp, unsigned int code, unsigned long arg) {
+    struct proc_info *info = filp->private_data;
+    struct pinner_batch batch;
+    struct pinner_cmd *cmds = NULL;
+    int *results = NULL;
+    unsigned i;
+    long ret;
+    
+    if (code != PINNER_IOC_BATCH) {
+        return -ENOTTY;
+    }
+    
+    if (copy_from_user(&batch, (void __user *) arg, sizeof(struct pinner_batch)) != 0) {
+        printk(KERN_ALERT "pinner: batch: could not copy batch struct from userspace\n");
+        return -EFAULT;
+    }
+    if (batch.num_cmds == 0) return 0;
+    if (batch.num_cmds > PINNER_MAX_BATCH) {
+        printk(KERN_ALERT "pinner: batch: too many commands [%u], max is [%u]\n", batch.num_cmds, PINNER_MAX_BATCH);
+        return -E2BIG;
+    }
+    
+    cmds = kvmalloc(batch.num_cmds * sizeof(struct pinner_cmd), GFP_KERNEL);
+    results = kvmalloc(batch.num_cmds * sizeof(int), GFP_KERNEL);
+    if (!cmds || !results) {
+        printk(KERN_ALERT "pinner: batch: could not allocate space for [%u] commands\n", batch.num_cmds);
+        ret = -ENOMEM;
+        goto ioctl_cleanup;
+    }
+    
+    if (copy_from_user(cmds, batch.cmds, batch.num_cmds * sizeof(struct pinner_cmd)) != 0) {
+        printk(KERN_ALERT "pinner: batch: could not copy commands from userspace\n");
+        ret = -EFAULT;
+        goto ioctl_cleanup;
+    }
+    
+    for (i = 0; i < batch.num_cmds; i++) {
+        results[i] = pinner_do_cmd(&(cmds[i]), info);
+        if (results[i] < 0 && (batch.flags & PINNER_BATCH_STOP_ON_ERROR)) {
+            i++;
             break;
         }
-        default:
-            printk(KERN_ALERT "pinner: unrecognized command code [%u]\n", cmd.cmd);
-            return -ENOSYS;
     }
-	
-	return 0;
+    ret = i;
+    
+    if (batch.results && copy_to_user(batch.results, results, i * sizeof(int)) != 0) {
+        printk(KERN_ALERT "pinner: batch: could not copy results to userspace\n");
+        ret = -EFAULT;
+    }
+    
+    ioctl_cleanup:
+    kvfree(cmds);
+    kvfree(results);
+    return ret;
 }
 
 
 //Structs for registering with misc devices
 static struct file_operations pinner_fops = {
+	.owner = THIS_MODULE, //Can't rmmod while someone has the file open
 	.open = pinner_open,
 	.write = pinner_write,
+	.unlocked_ioctl = pinner_ioctl,
+	.mmap = pinner_mmap,
 	.release = pinner_release
 };
 
@@ -468,26 +999,63 @@ static struct miscdevice pinner_miscdev = {
 
 static int registered = 0;
 
+//The misc device isn't in the device tree, so it starts out with no DMA mask
+//(and on arm64, dummy DMA ops that refuse to allocate anything). Set it up as 
+//a non-coherent device that can reach all of memory
+static int pinner_setup_dma(struct device *dev) {
+    int rc;
+    
+    rc = dma_coerce_mask_and_coherent(dev, DMA_BIT_MASK(64));
+    if (rc < 0) return rc;
+    
+    //Passing a NULL node is safe on the kernels we target (4.14 and 4.19): 
+    //of_dma_get_range fails, so we get a DMA offset of 0 and a size from the 
+    //mask we just set. of_dma_is_coherent(NULL) says non-coherent, which is 
+    //right for the MPSoC's non-HPC ports, and of_iommu_configure(NULL) finds 
+    //no IOMMU. arch_setup_dma_ops then installs the normal arm64 DMA ops. On 
+    //4.18+, force_dma has to be true or it bails out before any of that
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+    return of_dma_configure(dev, NULL, true);
+#else
+    return of_dma_configure(dev, NULL);
+#endif
+}
+
 static int __init pinner_init(void) { 
     int rc;
     
+    pinner_wq = alloc_ordered_workqueue("pinner", 0);
+    if (!pinner_wq) {
+        printk(KERN_ALERT "pinner: could not allocate workqueue\n");
+        return -ENOMEM;
+    }
+    
     //Now that everything is safely initialized, make the driver available:
 	rc = misc_register(&pinner_miscdev);
 	if (rc < 0) {
 		printk(KERN_ALERT "Could not register pinner module\n");
-	} else {
-		printk(KERN_ALERT "pinner module inserted\n"); 
-		registered = 1;
+		destroy_workqueue(pinner_wq);
+		return rc;
 	}
-    
-	return rc; //Propagate error code
+	registered = 1;
+	
+	rc = pinner_setup_dma(pinner_miscdev.this_device);
+	if (rc < 0) {
+		printk(KERN_ALERT "pinner: could not set up DMA for the device\n");
+		misc_deregister(&pinner_miscdev);
+		registered = 0;
+		destroy_workqueue(pinner_wq);
+		return rc;
+	}
+	smp_store_release(&dma_ready, 1);
+	
+	printk(KERN_ALERT "pinner module inserted\n"); 
+	return 0;
 } 
 
 static void pinner_exit(void) { 
-    //Remove all pinnings and free all proc_infos	
-	if (registered) misc_deregister(&pinner_miscdev);
-	
-    //Probably don't need to lock mutex, since driver has been unregistered
+    //Remove all pinnings and free all proc_infos
+    //Probably don't need to lock mutex, since nobody has the file open
     //mutex_lock(&users_mutex);
     while (!list_empty(&users)) {
         printk(KERN_ALERT "Warning: pinner exit function is freeing things that should have already been freed...\n");
@@ -495,6 +1063,12 @@ static void pinner_exit(void) {
     }
     //mutex_unlock(&users_mutex);
     
+    //Waits for all the queued unpins to finish. They unmap and free memory 
+    //with the misc device, so this has to happen before it goes away
+    destroy_workqueue(pinner_wq);
+    
+	if (registered) misc_deregister(&pinner_miscdev);
+	
 	printk(KERN_ALERT "pinner module removed\n"); 
 } 
 
@@ -2,11 +2,48 @@
 #define PINNER_PRIVATE_H 1
 
 #include <linux/scatterlist.h> //For scatterlist struct
+#include <linux/dma-mapping.h> //For enum dma_data_direction
+#include <linux/atomic.h> //For atomic_t
+#include <linux/hashtable.h> //For DECLARE_HASHTABLE
+#include <linux/kref.h> //For struct kref
+#include <linux/mutex.h> //For struct mutex
+#include <linux/rcupdate.h> //For struct rcu_head
+#include <linux/wait.h> //For wait_queue_head_t
+#include <linux/workqueue.h> //For struct work_struct
+
+//Each proc_info has 2^PINNER_HASH_BITS buckets for looking up pinnings
+#define PINNER_HASH_BITS 10
+
+//Pages are pinned (and unpinned) this many at a time, with a chance to 
+//reschedule in between. Must be a power of 2
+#define PINNER_GUP_CHUNK 1024
 
 struct pinning {
-    struct list_head list;
+    struct hlist_node node; //In the proc_info's hashtable, keyed by magic
+    struct rcu_head rcu; //Lookups don't take the lock, so freeing waits for RCU
+    struct kref ref; //One for the hashtable, plus one per command using it
+    struct work_struct free_work; //Unpinning is done later, on pinner_wq
+    struct proc_info *info; //Whose pending count to update once it's freed
     int num_sg_ents;
+    int num_dma_ents; //What dma_map_sg returned. An IOMMU can merge entries
     struct scatterlist *sglist;
+    //Every page we pinned. We can't get these back from the scatterlist, since
+    //an sglist entry can cover several physically contiguous pages
+    int num_pages;
+    struct page **pages;
+    //User virtual address and size of the pinned buffer, so we can turn an 
+    //address range into scatterlist entries
+    unsigned long usr_start;
+    unsigned usr_sz;
+    enum dma_data_direction dir; //Used for mapping and every sync
+    int mapped; //Set once dma_map_sg worked, so error paths know whether to unmap
+    //For PINNER_ALLOC: memory from dma_alloc_attrs instead of user pages. 
+    //cpu_addr is NULL for normal pinnings
+    void *cpu_addr;
+    dma_addr_t dma_handle;
+    size_t alloc_sz;
+    unsigned long attrs;
+    atomic_t mmap_count; //We can't free it while userspace still has it mapped
     unsigned magic; //Helps prevent problems where the user accidentally (or
     //on purpose) fiddled around with the handle we gave them. Should be generated
     //with get_random_bytes.
@@ -14,7 +51,15 @@ struct pinning {
 
 struct proc_info {
     struct list_head list;
-    struct list_head pinning_list;
+    //Pinnings, keyed by magic. Lookups use RCU, and lock has to be held to 
+    //add or remove one
+    DECLARE_HASHTABLE(pinnings, PINNER_HASH_BITS);
+    struct mutex lock;
+    //Number of pinnings waiting on pinner_wq to be freed. pending_wq is woken
+    //up whenever it goes down
+    atomic_t pending;
+    wait_queue_head_t pending_wq;
+    struct work_struct free_work; //The struct itself is freed on pinner_wq too
     unsigned magic; //Helps prevent problems where the user accidentally (or
     //on purpose) fiddled around with the handle we gave them. Should be generated
     //with get_random_bytes.
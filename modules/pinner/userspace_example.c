@@ -9,6 +9,7 @@
 
 int main() {
     char *mybuf = NULL;
+    struct pinner_physlist *plist = NULL;
     int fd = -1;
     
     int i;
@@ -26,7 +27,13 @@ int main() {
     
     //Driver will fill these with pinning information
     struct pinner_handle handle;
-    struct pinner_physlist plist;
+    //The physlist has to have room for one entry per page, in the worst case
+    plist = malloc(PINNER_PHYSLIST_SIZE(PINNER_PHYSLIST_WORST_CASE(BUF_SIZE)));
+    if (!plist) {
+        perror("Could not allocate physlist");
+        goto cleanup;
+    }
+    plist->max_entries = PINNER_PHYSLIST_WORST_CASE(BUF_SIZE);
     
     //Pin the buffer
     struct pinner_cmd pin_cmd = {
@@ -34,7 +41,7 @@ int main() {
         .usr_buf = mybuf,
         .usr_buf_sz = BUF_SIZE,
         .handle = &handle,
-        .physlist = &plist
+        .physlist = plist
     };
     n = write(fd, &pin_cmd, sizeof(struct pinner_cmd));
     if (n < 0) {
@@ -43,9 +50,9 @@ int main() {
     }
     
     //Print out physical address info
-    printf("plist.num_entries = %u\n", plist.num_entries);
-    for (int i = 0; i < plist.num_entries; i++) {
-        printf("SG entry: address 0x%lX with length %u\n", plist.entries[i].addr, plist.entries[i].len);
+    printf("plist->num_entries = %u\n", plist->num_entries);
+    for (int i = 0; i < plist->num_entries; i++) {
+        printf("SG entry: address 0x%lX with length %u\n", plist->entries[i].addr, plist->entries[i].len);
     }
     
     //Example of flushing the cache for the buffer. You only need to do this if
@@ -91,5 +98,6 @@ int main() {
     
     cleanup:
     if (mybuf) free(mybuf);
+    if (plist) free(plist);
     if (fd != -1) close(fd);
 }
@@ -5,6 +5,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <endian.h>
 #include "axidma.h"
 #include "pinner.h"
 #include "pinner_fns.h"
@@ -30,8 +34,11 @@ typedef struct {
     uint32_t    MM2S_curdesc_msb;
     uint32_t    MM2S_taildesc_lsb;
     uint32_t    MM2S_taildesc_msb;
-    
-    uint32_t    unused[6];
+    uint32_t    MM2S_SA_lsb; //Simple mode only
+    uint32_t    MM2S_SA_msb; //Simple mode only
+    uint32_t    unused[2];
+    uint32_t    MM2S_LENGTH; //Simple mode only
+    uint32_t    SG_CTL;
     
     uint32_t    S2MM_DMACR;
     uint32_t    S2MM_DMASR;
@@ -39,8 +46,52 @@ typedef struct {
     uint32_t    S2MM_curdesc_msb;
     uint32_t    S2MM_taildesc_lsb;
     uint32_t    S2MM_taildesc_msb;
+    uint32_t    S2MM_DA_lsb; //Simple mode only
+    uint32_t    S2MM_DA_msb; //Simple mode only
+    uint32_t    unused2[2];
+    uint32_t    S2MM_LENGTH; //Simple mode only
 } axidma_regs;
 
+//The MM2S and S2MM channels have the same register layout for the parts we 
+//use, so the transfer code just takes a pointer to one of these
+typedef struct {
+    uint32_t    DMACR;
+    uint32_t    DMASR;
+    uint32_t    curdesc_lsb;
+    uint32_t    curdesc_msb;
+    uint32_t    taildesc_lsb;
+    uint32_t    taildesc_msb;
+    //These are only there when the AXI DMA is built without the SG engine
+    uint32_t    addr_lsb;
+    uint32_t    addr_msb;
+    uint32_t    unused[2];
+    uint32_t    length;
+} axidma_chan_regs;
+
+//Error bits in DMASR (DMAIntErr, DMASlvErr, DMADecErr, SGIntErr, SGSlvErr, 
+//SGDecErr)
+#define DMASR_ERR_MASK 0x770
+
+//Other DMASR bits we care about in simple mode
+#define DMASR_IDLE      (1 << 1)
+#define DMASR_SG_INCLD  (1 << 3)
+
+//Longest transfer the LENGTH register can hold (if the buffer length register
+//width is set to its maximum of 26 bits)
+#define SIMPLE_MAX_LEN  ((1u << 26) - 1)
+
+//Be nice to the other hyperthread/core while spinning
+#if defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ volatile("yield" ::: "memory")
+#elif defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __sync_synchronize()
+#endif
+
+#define MM2S_CHAN(regs) ((volatile axidma_chan_regs *) &((regs)->MM2S_DMACR))
+#define S2MM_CHAN(regs) ((volatile axidma_chan_regs *) &((regs)->S2MM_DMACR))
+
 //Functions to open and close an AXI DMA context.
 axidma_ctx* axidma_open(char const* path) {
     int fd = -1;
@@ -67,6 +118,30 @@ axidma_ctx* axidma_open(char const* path) {
     ret->fd = fd;
     ret->reg_base = reg_base;
     ret->lst = NULL;
+    ret->mm2s_lst = NULL;
+    ret->spin_ns = AXIDMA_DEFAULT_SPIN_NS;
+    ret->irq_count = 0;
+    ret->pp_lists = NULL;
+    ret->pp_num = 0;
+    for (int i = 0; i < 2; i++) {
+        axidma_coalesce *co = &(ret->coalesce[i]);
+        memset(co, 0, sizeof(axidma_coalesce));
+        co->delay = AXIDMA_DEFAULT_IRQ_DELAY;
+    }
+    
+    //Drivers like uio_pdrv_genirq mask the interrupt until we write a 1. UIO 
+    //fails that write with EIO (ENOSYS on older kernels) when the driver has 
+    //no irqcontrol, so find out once here which kind of driver we have
+    unsigned one = 1;
+    if (write(fd, &one, sizeof(one)) == sizeof(one)) {
+        ret->irq_control = 1;
+    } else if (errno == EIO || errno == ENOSYS) {
+        ret->irq_control = 0;
+    } else {
+        perror("Could not enable AXI DMA interrupt");
+        free(ret);
+        goto axidma_open_error;
+    }
     return ret;
     
     axidma_open_error:
@@ -77,129 +152,256 @@ axidma_ctx* axidma_open(char const* path) {
 
 
 void axidma_close(axidma_ctx *ctx) {
+    free(ctx->pp_lists);
     close(ctx->fd);
     munmap(ctx->reg_base, AXI_DMA_REG_SPAN);
     free(ctx);
 }
 
-//Some helper functions for the linked list
+void axidma_set_spin_budget(axidma_ctx *ctx, unsigned spin_ns) {
+    if (!ctx) return;
+    ctx->spin_ns = spin_ns;
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline volatile axidma_chan_regs *chan_regs(axidma_ctx *ctx, axidma_chan_id chan) {
+    volatile axidma_regs *regs = (volatile axidma_regs *) ctx->reg_base;
+    return (chan == AXIDMA_MM2S) ? MM2S_CHAN(regs) : S2MM_CHAN(regs);
+}
+
+static inline sg_list *chan_lst(axidma_ctx *ctx, axidma_chan_id chan) {
+    return (chan == AXIDMA_MM2S) ? ctx->mm2s_lst : ctx->lst;
+}
 
-static inline void sg_entry_init(sg_entry *node) {
-    node->next = node;
-    node->prev = node;
+//Returns the IRQThreshold and IRQDelay bits of DMACR
+static inline uint32_t coalesce_bits(axidma_coalesce const *co, unsigned threshold, int enable_timeout) {
+    unsigned delay = 0;
+    if (enable_timeout || co->target_irq_rate) delay = co->delay;
+    return (delay << 24) | ((threshold & 0xFF) << 16);
 }
 
-static void sg_entry_add_before(sg_entry *head, sg_entry *new) {
+//Threshold to use in ring or cyclic mode
+static unsigned ring_threshold(axidma_coalesce const *co) {
+    if (co->target_irq_rate) return co->cur_threshold;
+    return co->threshold ? co->threshold : 1;
+}
+
+//If the channel is running, updates its threshold right away
+static void apply_ring_coalesce(axidma_ctx *ctx, axidma_chan_id chan) {
+    sg_list *lst = chan_lst(ctx, chan);
+    if (!lst || lst->mode == SG_LIST_ONESHOT) return;
     
-    sg_entry *oldtail = head->prev;
+    volatile axidma_chan_regs *c = chan_regs(ctx, chan);
+    uint32_t cr = c->DMACR;
+    if (!(cr & 1)) return;
+    axidma_coalesce const *co = &(ctx->coalesce[chan]);
+    //Keep the old delay setting; we don't know if the timeout was enabled.
+    //Adaptive mode always needs it, though
+    uint32_t delay = (co->target_irq_rate && !(cr >> 24)) ? (co->delay << 24) : (cr & 0xFF000000);
+    c->DMACR = delay | ((ring_threshold(co) & 0xFF) << 16) | (cr & 0xFFFF);
+}
+
+int axidma_set_coalesce(axidma_ctx *ctx, axidma_chan_id chan, unsigned threshold, unsigned delay) {
+    if (!ctx) {
+        fprintf(stderr, "axidma_set_coalesce: invalid NULL context\n");
+        return -1;
+    }
+    if ((chan != AXIDMA_MM2S && chan != AXIDMA_S2MM) || threshold > 255 || delay < 1 || delay > 255) {
+        fprintf(stderr, "axidma_set_coalesce: invalid arguments\n");
+        return -1;
+    }
     
-    oldtail->next = new;
-    new->prev = oldtail;
+    axidma_coalesce *co = &(ctx->coalesce[chan]);
+    co->threshold = threshold;
+    co->delay = delay;
+    co->target_irq_rate = 0;
+    apply_ring_coalesce(ctx, chan);
+    return 0;
+}
+
+int axidma_set_adaptive_coalesce(axidma_ctx *ctx, axidma_chan_id chan, unsigned target_irq_rate) {
+    if (!ctx) {
+        fprintf(stderr, "axidma_set_adaptive_coalesce: invalid NULL context\n");
+        return -1;
+    }
+    if (chan != AXIDMA_MM2S && chan != AXIDMA_S2MM) {
+        fprintf(stderr, "axidma_set_adaptive_coalesce: invalid channel\n");
+        return -1;
+    }
     
-    new->next = head;
-    head->prev = new;
+    axidma_coalesce *co = &(ctx->coalesce[chan]);
+    co->target_irq_rate = target_irq_rate;
+    co->cur_threshold = 1;
+    co->window_start_ns = now_ns();
+    sg_list *lst = chan_lst(ctx, chan);
+    co->window_start_pkts = lst ? lst->num_dequeued : 0;
+    apply_ring_coalesce(ctx, chan);
+    return 0;
 }
 
-//This is not a general-purpose function. It adds the list pointed at by
-//sentinel, but not sentinel itself.
-static void sg_entry_add_list_before(sg_entry *head, sg_entry *sentinel) {
-    sg_entry *oldtail = head->prev;
+//Called whenever we find out about dequeued packets. Once per window, picks a 
+//new threshold from the measured packet rate
+static void adapt_coalesce(axidma_ctx *ctx, axidma_chan_id chan) {
+    axidma_coalesce *co = &(ctx->coalesce[chan]);
+    sg_list *lst = chan_lst(ctx, chan);
+    if (!co->target_irq_rate || !lst || lst->mode == SG_LIST_ONESHOT) return;
     
-    oldtail->next = sentinel->next;
-    sentinel->next->prev = oldtail;
+    uint64_t now = now_ns();
+    uint64_t elapsed = now - co->window_start_ns;
+    if (elapsed < AXIDMA_COALESCE_WINDOW_NS) return;
     
-    head->prev = sentinel->prev;
-    sentinel->prev->next = head;
+    uint64_t pkts = lst->num_dequeued - co->window_start_pkts;
+    co->window_start_ns = now;
+    co->window_start_pkts = lst->num_dequeued;
+    
+    //Packets per interrupt to hit the target rate. Never let more than half
+    //the ring fill up before we hear about it
+    uint64_t want = (pkts * 1000000000ull) / ((uint64_t) elapsed * co->target_irq_rate);
+    unsigned max = lst->num_entries / 2;
+    if (max > 255) max = 255;
+    if (want > max) want = max;
+    if (want < 1) want = 1;
+    
+    //Move halfway to the new value so one odd window doesn't make us jump
+    unsigned next = (co->cur_threshold + (unsigned) want + 1) / 2;
+    if (next == co->cur_threshold) return;
+    co->cur_threshold = next;
+    apply_ring_coalesce(ctx, chan);
 }
 
-//Create an sg_list object
-sg_list *axidma_list_new(void *sg_buf, physlist const *sg_plist,
-                         void *data_buf, physlist const *data_plist) 
-{
-    sg_list *lst = malloc(sizeof(sg_list));
-    if (!lst) {
-        perror("Could not allocate sg_list");
-        return NULL;
+int axidma_irq_fd(axidma_ctx const *ctx) {
+    if (!ctx) return -1;
+    return ctx->fd;
+}
+
+int axidma_ack_irq(axidma_ctx *ctx) {
+    if (!ctx) {
+        fprintf(stderr, "axidma_ack_irq: invalid NULL context\n");
+        return -1;
     }
     
-    sg_entry_init(&(lst->sentinel));
-    lst->to_vist = NULL;
+    struct pollfd pfd = {.fd = ctx->fd, .events = POLLIN};
+    int rc = poll(&pfd, 1, 0);
+    if (rc < 0) {
+        perror("axidma_ack_irq: could not poll UIO fd");
+        return -1;
+    }
+    if (rc == 0 || !(pfd.revents & POLLIN)) return 0;
     
-    lst->sg_buf = sg_buf;
-    lst->sg_plist = sg_plist;
-    lst->sg_offset = 0;
+    //UIO gives us the total number of interrupts so far
+    unsigned count;
+    if (read(ctx->fd, &count, sizeof(count)) != sizeof(count)) {
+        perror("axidma_ack_irq: could not read UIO fd");
+        return -1;
+    }
+    int ret = count - ctx->irq_count;
+    ctx->irq_count = count;
     
-    lst->data_buf = data_buf;
-    lst->data_plist = data_plist;
-    lst->data_offset = 0;
+    //Unmask the interrupt again if the driver masked it (see axidma_open)
+    if (ctx->irq_control) {
+        unsigned one = 1;
+        if (write(ctx->fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("axidma_ack_irq: could not re-enable interrupt");
+            return -1;
+        }
+    }
     
-    return lst;
+    return ret;
 }
 
+//Throws away any interrupt that UIO is holding on to, without blocking. 
+//Otherwise a blocking read() could return right away because of an interrupt 
+//from an earlier transfer
+static void drain_irq(axidma_ctx *ctx) {
+    axidma_ack_irq(ctx);
+}
 
-/*
- * Clears all the entries in an sg_list, except the sentinel 
-*/
-void axidma_free_list(sg_entry *sentinel) {    
-    //Step through linked list and free all the entries
-    sg_entry *e = sentinel->next;
-    while (e != sentinel) {
-        sg_entry *tmp = e->next;
-        free(e);
-        e = tmp;
+//Helper functions for dealing with physlists
+
+//Builds the lookup index for a physlist. Returns -1 on error
+static int physlist_index_init(physlist_index *idx, physlist const *plist) {
+    unsigned n = plist->num_entries;
+    
+    idx->plist = plist;
+    idx->starts = malloc((n + 1) * sizeof(unsigned));
+    if (!idx->starts) {
+        perror("Could not allocate physlist index");
+        return -1;
+    }
+    
+    //Prefix sums of the entry lengths
+    unsigned total = 0;
+    for (unsigned i = 0; i < n; i++) {
+        idx->starts[i] = total;
+        total += plist->entries[i].len;
+    }
+    idx->starts[n] = total;
+    
+    //Check if we can use the fast path. Only the middle entries have to be the
+    //same size; the first one can start partway through a page and the last
+    //one can be short
+    idx->stride = (n >= 2) ? plist->entries[1].len : 1;
+    for (unsigned i = 1; i < n; i++) {
+        unsigned len = plist->entries[i].len;
+        if ((i < n - 1) ? (len != idx->stride) : (len > idx->stride)) {
+            idx->stride = 0;
+            break;
+        }
     }
+    
+    return 0;
 }
 
-//Free an sg_list object
-void axidma_list_del(sg_list *lst) {
-    //Gracefully do nothing if lst is NULL
-    if (!lst) return;
-    axidma_free_list(&(lst->sentinel));
-    free(lst);
+static void physlist_index_free(physlist_index *idx) {
+    free(idx->starts);
+    idx->starts = NULL;
 }
 
-//Helper functions for dealing with physlists
-
 //Find the index of the entry which contains the byte at offset past the start
 //of the buffer (in virtual memory). Sets offset_in_entry to be the offset into
 //this particular entry. Returns -1 if not found.
-int get_entry_index(physlist const *plist, unsigned offset, unsigned *offset_in_entry) {
-    //Doesn't have to be efficient. Just does a dumb linear search
-    int i;
-    for (i = 0; i < plist->num_entries; i++) {
-        if (offset >= plist->entries[i].len) {
-            offset -= plist->entries[i].len;
-            continue;
-        } 
-        *offset_in_entry = offset;
-        return i; //Found
+static int get_entry_index(physlist_index const *idx, unsigned offset, unsigned *offset_in_entry) {
+    unsigned n = idx->plist->num_entries;
+    if (n == 0 || offset >= idx->starts[n]) {
+        return -1; //Not found
     }
     
-    return -1; //Not found
-}
-
-//Convert offset into virtual buffer into physical address. Returns NULL if not
-//found.
-uint64_t virt_to_phys(physlist const *plist, unsigned offset) {
-    //Doesn't have to be efficient. Just does a dumb linear search
-    for (int i = 0; i < plist->num_entries; i++) {
-        if (offset >= plist->entries[i].len) {
-            offset -= plist->entries[i].len;
-            continue;
+    unsigned i;
+    if (idx->stride) {
+        //Fast path: all the entries after the first are the same size
+        unsigned first_len = idx->starts[1] - idx->starts[0];
+        i = (offset < first_len) ? 0 : 1 + (offset - first_len) / idx->stride;
+    } else {
+        //Binary search for the last entry that starts at or before offset
+        unsigned lo = 0, hi = n - 1;
+        while (lo < hi) {
+            unsigned mid = lo + (hi - lo + 1) / 2;
+            if (idx->starts[mid] <= offset) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
         }
-        return plist->entries[i].addr + offset;
+        i = lo;
     }
-    //Error: not found in physlist
-    return (uint64_t) NULL;
+    
+    *offset_in_entry = offset - idx->starts[i];
+    return (int) i; //Found
 }
 
 //Scatter-gather entries must be in contiguous memory and aligned to 16 word 
 //boundaries. This function walks through a physlist to find the next chunk of
-//size sz after offset, and returns the offset. Returns AXIDMA_NOT_FOUND if 
-//nothing could be found
-static unsigned find_contiguous_aligned_after(physlist const *plist, unsigned offset, unsigned sz) {
+//size sz after offset, and returns the offset. The physical address of the 
+//chunk is written to *phys. Returns AXIDMA_NOT_FOUND if nothing could be found
+static unsigned find_contiguous_aligned_after(physlist_index const *idx, unsigned offset, unsigned sz, uint64_t *phys) {
+    physlist const *plist = idx->plist;
     unsigned offset_in_entry;
-    int ind = get_entry_index(plist, offset, &offset_in_entry);
+    int ind = get_entry_index(idx, offset, &offset_in_entry);
     if (ind == -1) {
         //No need to print anything, another function will deal with the error
         return AXIDMA_NOT_FOUND;
@@ -208,18 +410,15 @@ static unsigned find_contiguous_aligned_after(physlist const *plist, unsigned of
     while (ind < plist->num_entries) {
         //Find adjustment that would align to next 16-word (64 byte) boundary
         unsigned alignment = (unsigned)((plist->entries[ind].addr + offset_in_entry)&0x3F);
-        if (alignment != 0) {
-            unsigned adjustment = 0x40 - (alignment);
-            offset += adjustment;
-            offset_in_entry += adjustment;
-        }
+        unsigned adjustment = (alignment != 0) ? 0x40 - alignment : 0;
         
         //Termination condition:
         
         //Check if the desired sz can fit at the found location
         unsigned space_left = plist->entries[ind].len - offset_in_entry;
-        if (sz <= space_left) {
-            return offset; //This offset will work
+        if (adjustment < space_left && sz <= space_left - adjustment) {
+            *phys = plist->entries[ind].addr + offset_in_entry + adjustment;
+            return offset + adjustment; //This offset will work
         }
         
         //Increments:
@@ -236,74 +435,196 @@ static unsigned find_contiguous_aligned_after(physlist const *plist, unsigned of
     
 }
 
+//Upper bound on how many descriptors can fit in the SG buffer. Descriptors 
+//can't straddle physlist entries, so count each entry separately
+static unsigned max_descriptors(physlist const *plist) {
+    unsigned ret = 0;
+    for (int i = 0; i < plist->num_entries; i++) {
+        ret += plist->entries[i].len / sizeof(sg_descriptor);
+    }
+    return ret;
+}
+
+//Create an sg_list object
+sg_list *axidma_list_new(void *sg_buf, physlist const *sg_plist,
+                         void *data_buf, physlist const *data_plist) 
+{
+    sg_list *lst = malloc(sizeof(sg_list));
+    if (!lst) {
+        perror("Could not allocate sg_list");
+        return NULL;
+    }
+    
+    //Allocate all the sg_entries we could ever need up front
+    lst->capacity = max_descriptors(sg_plist);
+    lst->entries = malloc(lst->capacity * sizeof(sg_entry));
+    if (!lst->entries && lst->capacity != 0) {
+        perror("Could not allocate sg_entry array");
+        free(lst);
+        return NULL;
+    }
+    
+    //Build the physlist lookup indices. This is the only time we ever walk
+    //through the physlists linearly
+    if (physlist_index_init(&(lst->sg_idx), sg_plist) < 0) {
+        free(lst->entries);
+        free(lst);
+        return NULL;
+    }
+    if (physlist_index_init(&(lst->data_idx), data_plist) < 0) {
+        physlist_index_free(&(lst->sg_idx));
+        free(lst->entries);
+        free(lst);
+        return NULL;
+    }
+    lst->num_entries = 0;
+    lst->to_vist = AXIDMA_NOT_FOUND;
+    
+    lst->mode = SG_LIST_ONESHOT;
+    lst->to_release = 0;
+    lst->num_held = 0;
+    lst->max_packet = 0;
+    lst->num_dequeued = 0;
+    
+    lst->num_written = 0;
+    lst->num_dirty = 0;
+    lst->num_submitted = 0;
+    lst->prelink_phys = 0;
+    
+    lst->data_sync_fd = -1;
+    lst->data_sync_h = NULL;
+    
+    lst->leasing = 0;
+    lst->slots = NULL;
+    lst->num_slots = 0;
+    lst->spares = NULL;
+    lst->num_spares = 0;
+    lst->num_leased = 0;
+    
+    lst->sg_buf = sg_buf;
+    lst->sg_plist = sg_plist;
+    lst->sg_offset = 0;
+    
+    lst->data_buf = data_buf;
+    lst->data_plist = data_plist;
+    lst->data_offset = 0;
+    
+    axidma_set_buf_len_width(lst, AXIDMA_DEFAULT_BUF_LEN_WIDTH);
+    
+    return lst;
+}
+
 /*
- * Apportions a new buffer from the the user's data buffer, and appends the
- * necessary entries to the SG list
- * 
- * Returns 0 on success, SG_OUT_OF_MEM if there is no space for the next SG 
- * entry, or BUF_OUT_OF_MEM if there is no space for the desired buffer
+ * Clears all the entries in an sg_list. Since the entries are in a flat array,
+ * this is just a matter of resetting the counters
 */
-add_entry_code axidma_add_entry(sg_list *lst, unsigned sz) {
-    //Before we go down this road, check that the function arugments make sense
-    if (!lst || !sz) {
-        fprintf(stderr, "axidma_add_entry: Invalid function argument\n");
-        return ADD_ENTRY_ERROR;
+void axidma_clear_list(sg_list *lst) {
+    if (!lst) return;
+    lst->num_entries = 0;
+    lst->to_vist = AXIDMA_NOT_FOUND;
+    lst->mode = SG_LIST_ONESHOT;
+    lst->to_release = 0;
+    lst->num_held = 0;
+    lst->sg_offset = 0;
+    lst->data_offset = 0;
+    lst->num_written = 0;
+    lst->num_dirty = 0;
+    lst->num_submitted = 0;
+    lst->prelink_phys = 0;
+    lst->leasing = 0;
+    lst->num_slots = 0;
+    lst->num_spares = 0;
+    lst->num_leased = 0;
+}
+
+/*
+ * Sets the longest buffer a single descriptor can describe. We round down to a
+ * multiple of 64 bytes so that when a chunk gets split, the next descriptor's
+ * buffer stays nicely aligned
+*/
+void axidma_set_buf_len_width(sg_list *lst, unsigned width) {
+    if (!lst) return;
+    if (width < 8 || width > 26) {
+        fprintf(stderr, "axidma_set_buf_len_width: width must be between 8 and 26 bits\n");
+        return;
     }
-    
+    lst->max_desc_len = ((1u << width) - 1) & ~0x3Fu;
+}
+
+void axidma_set_max_packet(sg_list *lst, unsigned max_packet) {
+    if (!lst) return;
+    lst->max_packet = max_packet;
+}
+
+//Free an sg_list object
+void axidma_list_del(sg_list *lst) {
+    //Gracefully do nothing if lst is NULL
+    if (!lst) return;
+    physlist_index_free(&(lst->sg_idx));
+    physlist_index_free(&(lst->data_idx));
+    free(lst->entries);
+    free(lst->slots);
+    free(lst->spares);
+    free(lst);
+}
+
+/*
+ * Appends the SG entries for a packet of sz bytes starting at data_offset in 
+ * the data buffer. On success, *end_offset is set to the offset just past the
+ * end of the packet. This is the common part of axidma_add_entry and 
+ * axidma_add_mm2s_entry; it leaves lst->data_offset alone.
+*/
+static add_entry_code add_entries_at(sg_list *lst, unsigned data_offset, unsigned sz, unsigned *end_offset) {
     //Set up some variables we'll be using. We do not modify the state of lst
     //until we're sure that everything would succeed. These next few variables
     //just hold on to the prospective state changes
-    int ret = 0;
-    
-    //Will hold a temporary list of SG entries
-    sg_entry sentinel; 
-    sg_entry_init(&sentinel);
+    //New entries are built in the free part of the array, and only become 
+    //part of the list when we update num_entries at the end
+    sg_entry *first = lst->entries + lst->num_entries;
     
-    //These will be the new values of data_offset and sg_offset in lst
-    unsigned data_offset = lst->data_offset;
+    //These will be the new values of sg_offset and num_entries in lst
     unsigned sg_offset = lst->sg_offset;
+    unsigned num_new = 0;
     
     
     //First, check if there is space in the buffer memory. While we do that, 
     //we'll keep track of the scatter-gather entries we need to build
     unsigned offset_in_entry;
-    int ind = get_entry_index(lst->data_plist, data_offset, &offset_in_entry);
+    int ind = get_entry_index(&(lst->data_idx), data_offset, &offset_in_entry);
     if (ind == -1) {
-        ret = ADD_ENTRY_BUF_OOM;
-        goto axidma_add_entry_error;
+        return ADD_ENTRY_BUF_OOM;
     }
     
     //Now we begin the complicated process of building up the SG entries
     //This does NOT modify lst; we wait until everything would succeed before
     //doing that
     while (sz != 0) {
-        //Space left in this entry of the data physlist
-        unsigned space = lst->data_plist->entries[ind].len - offset_in_entry;
+        //Space left in this entry of the data physlist, up to what one 
+        //descriptor can hold
+        unsigned entry_left = lst->data_plist->entries[ind].len - offset_in_entry;
+        unsigned space = entry_left;
+        if (space > lst->max_desc_len) space = lst->max_desc_len;
         
         //Check if there would be room for an SG descriptor
-        sg_offset = find_contiguous_aligned_after(lst->sg_plist, sg_offset, sizeof(sg_descriptor));
-        if (sg_offset == AXIDMA_NOT_FOUND) {
-            ret = ADD_ENTRY_SG_OOM;
-            goto axidma_add_entry_error;
+        uint64_t sg_phys;
+        sg_offset = find_contiguous_aligned_after(&(lst->sg_idx), sg_offset, sizeof(sg_descriptor), &sg_phys);
+        if (sg_offset == AXIDMA_NOT_FOUND || lst->num_entries + num_new >= lst->capacity) {
+            return ADD_ENTRY_SG_OOM;
         }
         
         //Make an SG descriptor
-        sg_entry *e = malloc(sizeof(sg_entry));
-        if (!e) {
-            perror("Could not allocate sg_entry");
-            ret = ADD_ENTRY_ERROR;
-            goto axidma_add_entry_error;
-        }
+        sg_entry *e = first + num_new;
         e->sg_offset = sg_offset;
         e->data_offset = data_offset; //If a buffer spans several entries, 
                                       //only use the data_offset from the first
-        e->buf_phys = virt_to_phys(lst->data_plist, data_offset);
-        sg_entry_add_before(&sentinel, e);
+        e->buf_phys = lst->data_plist->entries[ind].addr + offset_in_entry;
+        e->sg_phys = sg_phys;
+        num_new++;
         e->is_EOF = 0; //These get set later
         e->is_SOF = 0; //ditto
+        e->slot = lst->num_entries + num_new - 1;
         
         //Perform increments and check termination conditions
-        offset_in_entry = 0;
         sg_offset += sizeof(sg_descriptor);
         if (space < sz) {
             //We'll need to do another iteration after this
@@ -316,240 +637,1406 @@ add_entry_code axidma_add_entry(sg_list *lst, unsigned sz) {
             data_offset += sz;
             break;
         }
+        //If there's more left in this entry of the data physlist, the next 
+        //descriptor picks up where this one stopped
+        if (space < entry_left) {
+            offset_in_entry += space;
+            continue;
+        }
+        
         //Try next entry in data_physlist, if there is one
+        offset_in_entry = 0;
         ind++;
         if (ind >= lst->data_plist->num_entries) {
             //No entries left
-            ret = ADD_ENTRY_BUF_OOM;
-            goto axidma_add_entry_error;
+            return ADD_ENTRY_BUF_OOM;
         }
     }
     
     //Set SOF and EOF:
-    sentinel.next->is_SOF = 1;
-    sentinel.prev->is_EOF = 1;
+    first->is_SOF = 1;
+    first[num_new - 1].is_EOF = 1;
     
     //At this point, we know we're finally safe to modify lst
     
-    sg_entry_add_list_before(&(lst->sentinel), &sentinel);
     lst->sg_offset = sg_offset;
-    lst->data_offset = data_offset;
+    lst->num_entries += num_new;
+    *end_offset = data_offset;
     
     return ADD_ENTRY_SUCCESS; //Success
+}
+
+/*
+ * Apportions a new buffer from the the user's data buffer, and appends the
+ * necessary entries to the SG list
+ * 
+ * Returns 0 on success, SG_OUT_OF_MEM if there is no space for the next SG 
+ * entry, or BUF_OUT_OF_MEM if there is no space for the desired buffer
+*/
+add_entry_code axidma_add_entry(sg_list *lst, unsigned sz) {
+    //Before we go down this road, check that the function arugments make sense
+    if (!lst || !sz) {
+        fprintf(stderr, "axidma_add_entry: Invalid function argument\n");
+        return ADD_ENTRY_ERROR;
+    }
     
-    axidma_add_entry_error:
+    unsigned end_offset;
+    add_entry_code rc = add_entries_at(lst, lst->data_offset, sz, &end_offset);
+    if (rc == ADD_ENTRY_SUCCESS) {
+        lst->data_offset = end_offset;
+    }
     
-    axidma_free_list(&sentinel);
-    return ret;
+    return rc;
+}
+
+/*
+ * For MM2S lists. Appends the SG entries needed to send the sz bytes starting 
+ * at buf as a single packet. Does not apportion anything from the data buffer
+*/
+add_entry_code axidma_add_mm2s_entry(sg_list *lst, void *buf, unsigned sz) {
+    //Before we go down this road, check that the function arugments make sense
+    if (!lst || !buf || !sz) {
+        fprintf(stderr, "axidma_add_mm2s_entry: Invalid function argument\n");
+        return ADD_ENTRY_ERROR;
+    }
+    if (buf < lst->data_buf) {
+        fprintf(stderr, "axidma_add_mm2s_entry: buffer is not inside the list's data buffer\n");
+        return ADD_ENTRY_ERROR;
+    }
+    
+    //add_entries_at will tell us if the packet runs off the end of the buffer
+    unsigned end_offset;
+    return add_entries_at(lst, (unsigned) (buf - lst->data_buf), sz, &end_offset);
+}
+
+//Next entry in the list, wrapping around from the last entry to the first. 
+//This is the order the hardware sees, since the last descriptor always points
+//back to the first one
+static inline unsigned ring_next(sg_list const *lst, unsigned i) {
+    return (i + 1 == lst->num_entries) ? 0 : i + 1;
+}
+
+//Pointer to the descriptor in the SG buffer for entry i
+static inline volatile sg_descriptor *sg_desc(sg_list const *lst, unsigned i) {
+    return (volatile sg_descriptor *) (lst->sg_buf + lst->entries[i].sg_offset);
+}
+
+//Resets the status field so the hardware can reuse a descriptor
+//Descriptor fields are little-endian, whatever the CPU is. The 64-bit 
+//versions write an address's lsb and msb words (which are next to each other 
+//and 8-byte aligned) in one store
+static inline uint32_t desc_load32(volatile uint32_t const *w) {
+    return le32toh(*w);
+}
+
+static inline void desc_store32(volatile uint32_t *w, uint32_t v) {
+    *w = htole32(v);
+}
+
+static inline void desc_store64(volatile uint32_t *lsb, uint64_t v) {
+    *(volatile uint64_t *) lsb = htole64(v);
+}
+
+static inline uint32_t desc_status(volatile sg_descriptor const *desc) {
+    return desc_load32(&(desc->status));
+}
+
+static inline void reset_sg_status(volatile sg_descriptor *desc) {
+    desc_store32(&(desc->status), 0);
+}
+
+//On aarch64, Linux lets userspace clean and invalidate cache lines by virtual
+//address, so we can flush just the descriptors we touched instead of asking 
+//the pinner to flush everything. Descriptors are 64-byte aligned, so each one 
+//is exactly one line. Invalidating (not just cleaning) matters: the hardware 
+//writes the status later, and we don't want to read a stale cached copy of it
+#if defined(__aarch64__)
+#define HAVE_USER_DCACHE_FLUSH 1
+static inline void flush_desc(volatile sg_descriptor *desc) {
+    __asm__ volatile("dc civac, %0" :: "r"(desc) : "memory");
+}
+static inline void flush_done(void) {
+    __asm__ volatile("dsb sy" ::: "memory");
+}
+//When we only want to read a line again, we don't need to wait for the 
+//maintenance to finish like dsb does, just keep our loads from going ahead of
+//it. (dc ivac would be the natural way to drop a line, but it isn't allowed 
+//at EL0, and a dc counts as a store for barriers, so dmb ld isn't enough)
+static inline void inval_done(void) {
+    __asm__ volatile("dmb sy" ::: "memory");
+}
+#else
+#define HAVE_USER_DCACHE_FLUSH 0
+static inline void flush_desc(volatile sg_descriptor *desc) {(void) desc;}
+static inline void flush_done(void) {}
+static inline void inval_done(void) {}
+#endif
+
+//Reads the status the hardware wrote. A plain load could keep hitting a stale
+//cached copy of the line forever, so throw the line away first. On CPUs where
+//we can't do that, anything that waits on a status needs coherent SG memory
+static inline uint32_t desc_status_fresh(volatile sg_descriptor *desc) {
+    flush_desc(desc);
+    inval_done();
+    return desc_status(desc);
 }
 
-//Actually writes an entry into RAM
-static void s2mm_write_sg_entry(void *sg_buf, physlist const *sg_plist, sg_entry *e) {
+//Actually writes an entry into RAM. The descriptor format is the same for both
+//channels (the S2MM channel just ignores the SOF and EOF bits in control)
+static void write_sg_entry(sg_list *lst, unsigned i) {
+    sg_entry const *e = lst->entries + i;
+    
     DBG_PRINT("%d", e->sg_offset);
     DBG_PRINT("%d", e->data_offset);
     DBG_PRINT("%d", e->len);
     DBG_PRINT("%d", e->is_SOF);
     DBG_PRINT("%d", e->is_EOF);
     DBG_PRINT("%lx", e->buf_phys);
-    DBG_PRINT("%lx", virt_to_phys(sg_plist, e->sg_offset));
+    DBG_PRINT("%lx", e->sg_phys);
     DBG_PRINT("%c", '\n');
     
-    volatile sg_descriptor *desc = (volatile sg_descriptor *) (sg_buf + e->sg_offset);
-    //Is endianness gonna bite me for this?
-    desc->control.sof = e->is_SOF;
-    desc->control.eof = e->is_EOF;
-    desc->control.len = e->len;
-    desc->status.complete = 0;
-    desc->status.decode_err = 0;
-    desc->status.eof = 0;
-    desc->status.int_err = 0;
-    desc->status.len = 0;
-    desc->status.slave_err = 0;
-    desc->status.sof = 0;
-    desc->buffer_lsb = (uint32_t) (e->buf_phys & 0xFFFFFFFF);
-    desc->buffer_msb = (uint32_t) ((e->buf_phys>>32) & 0xFFFFFFFF);
-    
-    uint64_t nextdesc_phys = virt_to_phys(sg_plist, e->next->sg_offset);
-    desc->next_desc_lsb = (uint32_t) (nextdesc_phys & 0xFFFFFFFF);
-    desc->next_desc_msb = (uint32_t) ((nextdesc_phys>>32) & 0xFFFFFFFF);
+    volatile sg_descriptor *desc = sg_desc(lst, i);
+    
+    //The last descriptor points back to the first. This doesn't matter for 
+    //normal transfers (the hardware stops at the tail), but lets ring mode work
+    uint64_t nextdesc_phys = lst->entries[ring_next(lst, i)].sg_phys;
+    
+    //Build the control word in a register, then write the whole descriptor 
+    //with three 64-bit stores (control and status share one, which also 
+    //clears the status)
+    uint32_t control = (e->len & SG_CTRL_LEN_MASK) 
+                     | (e->is_SOF ? SG_CTRL_SOF : 0) 
+                     | (e->is_EOF ? SG_CTRL_EOF : 0);
+    desc_store64(&(desc->next_desc_lsb), nextdesc_phys);
+    desc_store64(&(desc->buffer_lsb), e->buf_phys);
+    desc_store64(&(desc->control), (uint64_t) control);
 }
 
-void axidma_write_sg_list(axidma_ctx *ctx, sg_list *lst, int pinner_fd, handle *h) {
+//Widens [lo, hi) to cover entry i's descriptor in the SG buffer
+static inline void grow_sg_span(sg_list const *lst, unsigned i, unsigned *lo, unsigned *hi) {
+    unsigned off = lst->entries[i].sg_offset;
+    if (off < *lo) *lo = off;
+    if (off + sizeof(sg_descriptor) > *hi) *hi = off + sizeof(sg_descriptor);
+}
+
+//Common part of axidma_write_sg_list and axidma_write_mm2s_sg_list. Returns -1
+//if the list can't be written
+static int write_sg_list(char const *fn_name, axidma_ctx *ctx, sg_list *lst, int pinner_fd, handle *h) {
     //Validate inputs, just in case
     if (!ctx) {
-        fprintf(stderr, "axidma_s2mm_transfer: invalid NULL context\n");
-        return;
+        fprintf(stderr, "%s: invalid NULL context\n", fn_name);
+        return -1;
     }
     if (!lst) {
-        fprintf(stderr, "axidma_s2mm_transfer: invalid NULL list\n");
-        return;
+        fprintf(stderr, "%s: invalid NULL list\n", fn_name);
+        return -1;
     }
-    if (lst->sentinel.next == &(lst->sentinel)) {
-        fprintf(stderr, "axidma_s2mm_transfer: invalid list with no SG entries\n");
-        return;
+    if (lst->num_entries == 0) {
+        fprintf(stderr, "%s: invalid list with no SG entries\n", fn_name);
+        return -1;
+    }
+    //Rewriting would put leased buffers back on the ring while the 
+    //application still has them
+    if (lst->num_leased) {
+        fprintf(stderr, "%s: %u buffers are still leased. Give them back with axidma_s2mm_release_buf first\n", fn_name, lst->num_leased);
+        return -1;
     }
-    
-    ctx->lst = lst;
     
     //Set the to_visit field
-    lst->to_vist = lst->sentinel.next;
-    
-    //Step through linked list of SG entries and write each one to RAM
-    for (sg_entry *e = lst->sentinel.next; e != &(lst->sentinel); e = e->next) {
-        s2mm_write_sg_entry(lst->sg_buf, lst->sg_plist, e);
-    }
+    lst->to_vist = 0;
     
-    //Flush cache
-    flush_buf_cache(pinner_fd, h);
-}
-
-/*
- * Writes the scatter-gather list entries to memory, then starts the transfer.
- * Set wait_irq to 0 if you don't want to wait for the interrupt
- * Enable timeout turns on the DMA's timout register, but I wouldn't use it...
- * CALL axidma_write_sg_list FIRST!
-*/
-void axidma_s2mm_transfer(axidma_ctx *ctx, int wait_irq, int enable_timeout) {
-    //Validate inputs, just in case
-    if (!ctx) {
-        fprintf(stderr, "axidma_s2mm_transfer: invalid NULL context\n");
-        return;
-    }
-    if (!ctx->lst) {
-        fprintf(stderr, "SG List not written to RAM. Did you forget to call axidma_write_sg_list?\n");
-        return;
-    }
+    //Writing the list puts it back in the default mode
+    lst->mode = SG_LIST_ONESHOT;
+    lst->leasing = 0;
+    lst->to_release = 0;
+    lst->num_held = 0;
     
-    sg_list *lst = ctx->lst;
+    //Descriptors we've already written only need their status reset, and 
+    //only the ones the hardware could have written a status to. Check the 
+    //dirty count, not the cached status: a cached 0 doesn't mean the hardware
+    //didn't complete it. The exception is the old last descriptor, which has
+    //to link to the new entries instead of entry 0
+    unsigned first_new = lst->num_written;
+    if (first_new > lst->num_entries) first_new = 0;
+    if (first_new > 0 && first_new < lst->num_entries) first_new--;
     
-    //Coutn entries in the list;
-    int cnt = 0;
-    for (sg_entry *e = lst->sentinel.next; e != &(lst->sentinel); e = e->next) {
-        if (e->is_EOF) cnt++;
-        
-        volatile sg_descriptor *desc = (volatile sg_descriptor *) (lst->sg_buf + e->sg_offset);
+    //Also keep track of the part of the SG buffer we touch
+    unsigned lo = AXIDMA_NOT_FOUND, hi = 0;
+    unsigned num_reset = lst->num_dirty < first_new ? lst->num_dirty : first_new;
+    for (unsigned i = 0; i < num_reset; i++) {
+        volatile sg_descriptor *desc = sg_desc(lst, i);
+        reset_sg_status(desc);
+        flush_desc(desc);
+        grow_sg_span(lst, i, &lo, &hi);
     }
     
-    if (!cnt) {
-        fprintf(stderr, "axidma_s2mm_transfer: invalid SG list with no entries\n");
-        return;
+    //Step through the rest of the SG entries and write each one to RAM
+    for (unsigned i = first_new; i < lst->num_entries; i++) {
+        write_sg_entry(lst, i);
+        flush_desc(sg_desc(lst, i));
+        grow_sg_span(lst, i, &lo, &hi);
     }
+    lst->num_written = lst->num_entries;
+    lst->num_dirty = 0;
     
-    //Now we actually send the commands to the AXI DMA's registers
-    //This follows the programming sequence in the product guide. First, we 
-    //write the pointer to the first descriptor
-    volatile axidma_regs *regs = (volatile axidma_regs *) ctx->reg_base;
+    //Flush cache. Without a user-space flush, ask the pinner to clean just 
+    //the descriptors we touched
+    if (HAVE_USER_DCACHE_FLUSH) {
+        flush_done();
+    } else if (h && lo < hi) {
+        sync_buf_range(pinner_fd, h, lst->sg_buf + lo, hi - lo, PINNER_SYNC_FOR_DEVICE);
+    }
     
-    uint64_t curdesc_phys = virt_to_phys(lst->sg_plist, lst->sentinel.next->sg_offset);
-    DBG_PRINT("%lx", curdesc_phys);
-    DBG_PRINT("%lx", lst->sg_plist->entries[0].addr);
-    DBG_PRINT("%u", lst->sentinel.next->sg_offset);
-    DBG_PRINT("%c", '\n');
-    regs->S2MM_curdesc_lsb = (uint32_t) (curdesc_phys & 0xFFFFFFFF);
-    regs->S2MM_curdesc_msb = (uint32_t) ((curdesc_phys>>32) & 0xFFFFFFFF);
+    return 0;
+}
+
+void axidma_write_sg_list(axidma_ctx *ctx, sg_list *lst, int pinner_fd, handle *h) {
+    if (write_sg_list("axidma_write_sg_list", ctx, lst, pinner_fd, h) == 0) {
+        ctx->lst = lst;
+    }
+}
+
+void axidma_write_mm2s_sg_list(axidma_ctx *ctx, sg_list *lst, int pinner_fd, handle *h) {
+    if (write_sg_list("axidma_write_mm2s_sg_list", ctx, lst, pinner_fd, h) == 0) {
+        ctx->mm2s_lst = lst;
+    }
+}
+
+//Helper to write a 64-bit descriptor address into a pair of registers
+static inline void write_desc_reg(volatile uint32_t *lsb, volatile uint32_t *msb, sg_list const *lst, unsigned i) {
+    uint64_t phys = lst->entries[i].sg_phys;
+    *lsb = (uint32_t) (phys & 0xFFFFFFFF);
+    *msb = (uint32_t) ((phys>>32) & 0xFFFFFFFF);
+}
+
+//Points the channel's tail register at entry i. The hardware can now write a
+//status to any descriptor up to i, so write_sg_list has to reset them
+static inline void write_tail_reg(volatile axidma_chan_regs *chan, sg_list *lst, unsigned i) {
+    if (i + 1 > lst->num_dirty) lst->num_dirty = i + 1;
+    write_desc_reg(&(chan->taildesc_lsb), &(chan->taildesc_msb), lst, i);
+}
+
+/*
+ * Programs one of the channels with the list and starts it. This follows the
+ * programming sequence in the product guide, which is the same for MM2S and 
+ * S2MM
+*/
+//Clears the run/stop bit, then waits for the halted bit in the status 
+//register. The product guide says this can take a little while if a transfer
+//is in flight, but it shouldn't take forever. Returns -1 if it never halts
+static int halt_chan(char const *fn_name, volatile axidma_chan_regs *chan) {
+    chan->DMACR &= ~1;
+    int tries;
+    for (tries = 0; tries < 1000000; tries++) {
+        if (chan->DMASR & 1) return 0;
+    }
+    fprintf(stderr, "%s: channel did not halt\n", fn_name);
+    return -1;
+}
+
+//Biggest IRQThreshold that divides cnt
+static unsigned pick_threshold(unsigned cnt) {
+    if (cnt <= 255) return cnt;
+    unsigned threshold;
+    for (threshold = 255; cnt % threshold; threshold--);
+    return threshold;
+}
+
+//Waits (according to wait_irq) until the hardware sets the complete bit in 
+//desc. When blocking on interrupts, gives up after max_irqs of them (0 means 
+//no limit). Returns 1 if desc is done
+static int wait_for_desc(char const *fn_name, axidma_ctx *ctx, volatile axidma_chan_regs *chan,
+                         volatile sg_descriptor *desc, int wait_irq, unsigned max_irqs) 
+{
+    if (wait_irq == AXIDMA_WAIT_POLL || wait_irq == AXIDMA_WAIT_HYBRID) {
+        //Spin on the complete bit of the descriptor. Each check invalidates
+        //the one line and reloads it from DRAM (see desc_status_fresh), which
+        //is still a lot cheaper than a register read, so we only look at the
+        //status register once in a while to catch errors
+        uint64_t deadline = now_ns() + ctx->spin_ns;
+        for (unsigned iter = 1; ; iter++) {
+            if (desc_status_fresh(desc) & SG_STS_COMPLETE) return 1;
+            
+            if ((iter & 0xFF) == 0) {
+                uint32_t sr = chan->DMASR;
+                if ((sr & 1) && (sr & DMASR_ERR_MASK)) {
+                    fprintf(stderr, "%s: DMA halted with error (DMASR = 0x%08x)\n", fn_name, sr);
+                    return 0;
+                }
+                if (wait_irq == AXIDMA_WAIT_HYBRID && now_ns() > deadline) break;
+            }
+            cpu_relax();
+        }
+        //Only AXIDMA_WAIT_HYBRID gets here, once it runs out of time
+    }
+    
+    if (wait_irq) {        
+        //At this point, transfer has started. Wait for the interrupt!
+        if (wait_irq == AXIDMA_WAIT_IRQ) {
+            fprintf(stderr,"Waiting for DMA to finish!\n");
+            fflush(stdout);
+        }
+        
+        //If the list needed more than one interrupt, keep waiting until we've
+        //seen all of them (or the hardware is done anyway)
+        unsigned start_count = ctx->irq_count;
+        while (!(desc_status_fresh(desc) & SG_STS_COMPLETE)) {
+            if (max_irqs && ctx->irq_count - start_count >= max_irqs) break;
+            unsigned pending;
+            if (read(ctx->fd, &pending, sizeof(pending)) != sizeof(pending)) break;
+            ctx->irq_count = pending;
+            if ((chan->DMASR & 1) && (chan->DMASR & DMASR_ERR_MASK)) break;
+        }
+        DBG_PRINT("%x", chan->DMACR);
+        DBG_PRINT("%x", chan->DMASR);
+        DBG_PUTS("Interrupt received");
+    }
+    
+    return (desc_status_fresh(desc) & SG_STS_COMPLETE) != 0;
+}
+
+static void start_sg_transfer(char const *fn_name, axidma_ctx *ctx, axidma_chan_id chan_id,
+                              sg_list *lst, int wait_irq, int enable_timeout) 
+{
+    volatile axidma_chan_regs *chan = chan_regs(ctx, chan_id);
+    axidma_coalesce const *co = &(ctx->coalesce[chan_id]);
+    
+    //Coutn entries in the list;
+    int cnt = 0;
+    for (unsigned i = 0; i < lst->num_entries; i++) {
+        if (lst->entries[i].is_EOF) cnt++;
+    }
+    
+    if (!cnt) {
+        fprintf(stderr, "%s: invalid SG list with no entries\n", fn_name);
+        return;
+    }
+    
+    //We can only write curdesc while the channel is halted. After a transfer 
+    //finishes the channel is just idle, so stop it first
+    if (!(chan->DMASR & 1) && halt_chan(fn_name, chan) < 0) return;
+    
+    //Now we actually send the commands to the AXI DMA's registers
+    //This follows the programming sequence in the product guide. First, we 
+    //write the pointer to the first descriptor
+    DBG_PRINT("%lx", lst->sg_plist->entries[0].addr);
+    DBG_PRINT("%u", lst->entries[0].sg_offset);
+    DBG_PRINT("%c", '\n');
+    write_desc_reg(&(chan->curdesc_lsb), &(chan->curdesc_msb), lst, 0);
+    
+    //IRQThreshold is only 8 bits. If there are more packets than that, use 
+    //the biggest threshold that evenly divides the packet count, so the last 
+    //interrupt lines up with the end of the list
+    unsigned threshold = co->threshold ? co->threshold : pick_threshold(cnt);
+    unsigned expected_irqs = cnt / threshold;
+    if (!expected_irqs) expected_irqs = 1;
     
     //Enable all interrupts, set cyclic mode, and set run/stop to 1
     //Also, set timeout to something reasonable?
+    //When polling, we only want to hear about errors
+    uint32_t irq_bits = (wait_irq == AXIDMA_WAIT_POLL) ? 0b100000000000000 : 0b111000000000000;
+    chan->DMACR = coalesce_bits(co, threshold, enable_timeout) | irq_bits | 1; 
     
-    regs->S2MM_DMACR = (enable_timeout ? (200<<24) : 0) | ((cnt & 0xFF) << 16) | (0b111000000000001); 
+    //Get rid of leftover interrupts so we only wait for this transfer's
+    if (wait_irq) drain_irq(ctx);
     
     //Now write the pointer to the last descriptor. This starts the transfer
-    uint64_t taildesc_phys = virt_to_phys(lst->sg_plist, lst->sentinel.prev->sg_offset);
-    regs->S2MM_taildesc_lsb = (uint32_t) (taildesc_phys & 0xFFFFFFFF);
-    regs->S2MM_taildesc_msb = (uint32_t) ((taildesc_phys>>32) & 0xFFFFFFFF);
+    write_tail_reg(chan, lst, lst->num_entries - 1);
     
-    if (wait_irq) {        
-        //At this point, transfer has started. Wait for the interrupt!
-        fprintf(stderr,"Waiting for DMA to finish!\n");
-        fflush(stdout);
+    wait_for_desc(fn_name, ctx, chan, sg_desc(lst, lst->num_entries - 1), wait_irq, expected_irqs);
+}
+
+/*
+ * Writes the scatter-gather list entries to memory, then starts the transfer.
+ * Set wait_irq to 0 if you don't want to wait for the interrupt
+ * Enable timeout turns on the DMA's timout register, but I wouldn't use it...
+ * CALL axidma_write_sg_list FIRST!
+*/
+void axidma_s2mm_transfer(axidma_ctx *ctx, int wait_irq, int enable_timeout) {
+    //Validate inputs, just in case
+    if (!ctx) {
+        fprintf(stderr, "axidma_s2mm_transfer: invalid NULL context\n");
+        return;
+    }
+    if (!ctx->lst) {
+        fprintf(stderr, "SG List not written to RAM. Did you forget to call axidma_write_sg_list?\n");
+        return;
+    }
+    
+    start_sg_transfer("axidma_s2mm_transfer", ctx, AXIDMA_S2MM, ctx->lst, wait_irq, enable_timeout);
+}
+
+/*
+ * Starts sending the packets in the list written by axidma_write_mm2s_sg_list.
+ * CALL axidma_write_mm2s_sg_list FIRST!
+*/
+void axidma_mm2s_transfer(axidma_ctx *ctx, int wait_irq, int enable_timeout) {
+    //Validate inputs, just in case
+    if (!ctx) {
+        fprintf(stderr, "axidma_mm2s_transfer: invalid NULL context\n");
+        return;
+    }
+    if (!ctx->mm2s_lst) {
+        fprintf(stderr, "SG List not written to RAM. Did you forget to call axidma_write_mm2s_sg_list?\n");
+        return;
+    }
+    
+    start_sg_transfer("axidma_mm2s_transfer", ctx, AXIDMA_MM2S, ctx->mm2s_lst, wait_irq, enable_timeout);
+}
+
+//Ring, lease and cyclic mode can't return a packet that wraps around from the
+//last buffer to the first, so make sure every buffer (the descriptors from an
+//SOF to an EOF) can hold the longest packet. Returns -1 if one can't
+static int check_ring_bufs(char const *fn_name, sg_list const *lst) {
+    if (lst->max_packet == 0) {
+        fprintf(stderr, "%s: unknown packet size. Did you forget to call axidma_set_max_packet?\n", fn_name);
+        return -1;
+    }
+    
+    unsigned buf_len = 0;
+    for (unsigned i = 0; i < lst->num_entries; i++) {
+        if (lst->entries[i].is_SOF) buf_len = 0;
+        buf_len += lst->entries[i].len;
+        if (lst->entries[i].is_EOF && buf_len < lst->max_packet) {
+            fprintf(stderr, "%s: a %u byte buffer can't hold a %u byte packet\n", fn_name, buf_len, lst->max_packet);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Starts the S2MM channel in ring mode. Every descriptor starts out owned by 
+ * the hardware, and they come back to it in axidma_s2mm_ring_release
+*/
+void axidma_s2mm_ring_start(axidma_ctx *ctx, int enable_timeout) {
+    //Validate inputs, just in case
+    if (!ctx) {
+        fprintf(stderr, "axidma_s2mm_ring_start: invalid NULL context\n");
+        return;
+    }
+    if (!ctx->lst) {
+        fprintf(stderr, "SG List not written to RAM. Did you forget to call axidma_write_sg_list?\n");
+        return;
+    }
+    
+    sg_list *lst = ctx->lst;
+    if (check_ring_bufs("axidma_s2mm_ring_start", lst) < 0) return;
+    lst->mode = SG_LIST_RING;
+    lst->to_vist = 0;
+    lst->to_release = 0;
+    lst->num_held = 0;
+    
+    volatile axidma_regs *regs = (volatile axidma_regs *) ctx->reg_base;
+    volatile axidma_chan_regs *chan = S2MM_CHAN(regs);
+    
+    if (!(chan->DMASR & 1) && halt_chan("axidma_s2mm_ring_start", chan) < 0) return;
+    write_desc_reg(&(chan->curdesc_lsb), &(chan->curdesc_msb), lst, 0);
+    
+    //Same as a normal transfer, except by default we want to hear about every
+    //packet since there is no "end" of the transfer
+    axidma_coalesce *co = &(ctx->coalesce[AXIDMA_S2MM]);
+    co->cur_threshold = 1;
+    chan->DMACR = coalesce_bits(co, ring_threshold(co), enable_timeout) | (0b111000000000001);
+    
+    //Give the hardware the whole ring to start with
+    write_tail_reg(chan, lst, lst->num_entries - 1);
+}
+
+//Makes sure every entry has a slot, and that there's room for extra more
+static int grow_slots(sg_list *lst, unsigned extra) {
+    unsigned first_new = lst->num_slots;
+    unsigned n = (lst->num_slots ? lst->num_slots : lst->num_entries) + extra;
+    
+    sg_slot *slots = realloc(lst->slots, n * sizeof(sg_slot));
+    if (!slots) return -1;
+    lst->slots = slots;
+    unsigned *spares = realloc(lst->spares, n * sizeof(unsigned));
+    if (!spares) return -1;
+    lst->spares = spares;
+    
+    if (first_new == 0) {
+        for (unsigned i = 0; i < lst->num_entries; i++) {
+            sg_entry *e = lst->entries + i;
+            sg_slot *sl = lst->slots + i;
+            sl->phys = e->buf_phys;
+            sl->data_offset = e->data_offset;
+            sl->len = e->len;
+            sl->leased = 0;
+            sl->on_ring = 1;
+            sl->next = AXIDMA_NOT_FOUND;
+            e->slot = i;
+        }
+        lst->num_slots = lst->num_entries;
+    }
+    return 0;
+}
+
+unsigned axidma_add_spare_bufs(sg_list *lst, unsigned sz, unsigned count) {
+    if (!lst || !sz) return 0;
+    if (sz > lst->max_desc_len) {
+        fprintf(stderr, "axidma_add_spare_bufs: spare buffers can't be bigger than one descriptor (%u bytes)\n", lst->max_desc_len);
+        return 0;
+    }
+    if (lst->num_slots && lst->num_slots - lst->num_spares < lst->num_entries) {
+        fprintf(stderr, "axidma_add_spare_bufs: add all the entries before the spares\n");
+        return 0;
+    }
+    if (grow_slots(lst, count) < 0) {
+        fprintf(stderr, "axidma_add_spare_bufs: out of memory\n");
+        return 0;
+    }
+    
+    unsigned added;
+    for (added = 0; added < count; added++) {
+        uint64_t phys;
+        unsigned off = find_contiguous_aligned_after(&(lst->data_idx), lst->data_offset, sz, &phys);
+        if (off == AXIDMA_NOT_FOUND) break;
         
-        unsigned pending;
-        read(ctx->fd, &pending, sizeof(pending));
-        DBG_PRINT("%x", regs->S2MM_DMACR);
-        DBG_PRINT("%x", regs->S2MM_DMASR);
-        DBG_PUTS("Interrupt received");
+        unsigned ind = lst->num_slots++;
+        sg_slot *sl = lst->slots + ind;
+        sl->phys = phys;
+        sl->data_offset = off;
+        sl->len = sz;
+        sl->leased = 0;
+        sl->on_ring = 0;
+        sl->next = AXIDMA_NOT_FOUND;
+        lst->spares[lst->num_spares++] = ind;
+        
+        lst->data_offset = off + sz;
+    }
+    
+    return added;
+}
+
+//Points entry i (and its descriptor) at a spare slot. Returns -1 if there 
+//isn't a big enough one
+static int swap_in_spare(sg_list *lst, unsigned i) {
+    sg_entry *e = lst->entries + i;
+    if (!lst->num_spares || lst->slots[lst->spares[lst->num_spares - 1]].len < e->len) return -1;
+    
+    unsigned sp = lst->spares[--lst->num_spares];
+    sg_slot *sl = lst->slots + sp;
+    lst->slots[e->slot].on_ring = 0;
+    sl->on_ring = 1;
+    e->slot = sp;
+    e->buf_phys = sl->phys;
+    e->data_offset = sl->data_offset;
+    
+    desc_store64(&(sg_desc(lst, i)->buffer_lsb), sl->phys);
+    return 0;
+}
+
+//Lease mode version of axidma_s2mm_ring_release. Gives back held descriptors 
+//in order, swapping in spares for buffers the application still has. Stops at
+//the first one it can't re-arm
+static void lease_rearm(axidma_ctx *ctx, sg_list *lst) {
+    unsigned last = AXIDMA_NOT_FOUND;
+    unsigned i = lst->to_release;
+    while (lst->num_held) {
+        if (lst->slots[lst->entries[i].slot].leased && swap_in_spare(lst, i) < 0) break;
+        volatile sg_descriptor *desc = sg_desc(lst, i);
+        reset_sg_status(desc);
+        flush_desc(desc);
+        last = i;
+        i = ring_next(lst, i);
+        lst->num_held--;
+    }
+    lst->to_release = i;
+    if (last == AXIDMA_NOT_FOUND) return;
+    
+    __sync_synchronize();
+    flush_done();
+    
+    volatile axidma_chan_regs *chan = chan_regs(ctx, AXIDMA_S2MM);
+    write_tail_reg(chan, lst, last);
+}
+
+int axidma_s2mm_lease_start(axidma_ctx *ctx, int enable_timeout) {
+    //Validate inputs, just in case
+    if (!ctx) {
+        fprintf(stderr, "axidma_s2mm_lease_start: invalid NULL context\n");
+        return -1;
+    }
+    if (!ctx->lst) {
+        fprintf(stderr, "SG List not written to RAM. Did you forget to call axidma_write_sg_list?\n");
+        return -1;
+    }
+    
+    sg_list *lst = ctx->lst;
+    if (check_ring_bufs("axidma_s2mm_lease_start", lst) < 0) return -1;
+    if (!lst->num_slots && grow_slots(lst, 0) < 0) {
+        fprintf(stderr, "axidma_s2mm_lease_start: out of memory\n");
+        return -1;
     }
     
-    return;
+    //Buffers leased in an earlier run are still the application's
+    for (unsigned i = 0; i < lst->num_entries; i++) {
+        if (lst->slots[lst->entries[i].slot].leased && swap_in_spare(lst, i) < 0) {
+            fprintf(stderr, "axidma_s2mm_lease_start: not enough spare buffers to replace the ones still leased\n");
+            return -1;
+        }
+    }
+    
+    lst->leasing = 1;
+    axidma_s2mm_ring_start(ctx, enable_timeout);
+    return 0;
+}
+
+int axidma_s2mm_release_buf(axidma_ctx *ctx, s2mm_buf const *buf) {
+    if (!ctx || !ctx->lst || !buf) {
+        fprintf(stderr, "axidma_s2mm_release_buf: invalid NULL argument\n");
+        return -1;
+    }
+    
+    sg_list *lst = ctx->lst;
+    if (buf->id >= lst->num_slots || !lst->slots[buf->id].leased) {
+        fprintf(stderr, "axidma_s2mm_release_buf: buffer is not leased\n");
+        return -1;
+    }
+    
+    unsigned c = buf->id;
+    while (c != AXIDMA_NOT_FOUND) {
+        sg_slot *sl = lst->slots + c;
+        unsigned next = sl->next;
+        sl->leased = 0;
+        sl->next = AXIDMA_NOT_FOUND;
+        lst->num_leased--;
+        //If a spare took its place on the ring, it becomes a spare itself
+        if (!sl->on_ring) lst->spares[lst->num_spares++] = c;
+        c = next;
+    }
+    
+    if (lst->leasing && lst->mode == SG_LIST_RING) lease_rearm(ctx, lst);
+    return 0;
 }
 
 /*
- * Used for traversing buffers returned from an S2MM trasnfer
+ * Starts the S2MM channel in cyclic mode. The hardware ignores the complete
+ * bits and the tail pointer, and just follows the next pointers around forever
 */
-s2mm_buf axidma_dequeue_s2mm_buf(sg_list *lst) {
-    DBG_PUTS("Entered dequeue");
-    sg_entry *e = lst->to_vist;
+void axidma_s2mm_cyclic_start(axidma_ctx *ctx, int enable_timeout) {
+    //Validate inputs, just in case
+    if (!ctx) {
+        fprintf(stderr, "axidma_s2mm_cyclic_start: invalid NULL context\n");
+        return;
+    }
+    if (!ctx->lst) {
+        fprintf(stderr, "SG List not written to RAM. Did you forget to call axidma_write_sg_list?\n");
+        return;
+    }
     
-    if (!e) {
-        fprintf(stderr, "Cannot dequeue s2mm buffer from empty list\n");
-        s2mm_buf ret = {NULL, 0, END_OF_LIST};
-        return ret;
+    sg_list *lst = ctx->lst;
+    if (check_ring_bufs("axidma_s2mm_cyclic_start", lst) < 0) return;
+    
+    //The product guide says the tail pointer still has to be written to start
+    //the channel, but it should point to something that isn't part of the 
+    //chain. We use the next free slot in the SG buffer; the hardware never 
+    //actually fetches it
+    uint64_t dummy_phys;
+    unsigned dummy_offset = find_contiguous_aligned_after(&(lst->sg_idx), lst->sg_offset, sizeof(sg_descriptor), &dummy_phys);
+    if (dummy_offset == AXIDMA_NOT_FOUND) {
+        fprintf(stderr, "axidma_s2mm_cyclic_start: need room for one more descriptor in the SG buffer\n");
+        return;
     }
     
-    //If we have reached the end of the list...
-    if (e == &(lst->sentinel)) {
-        lst->to_vist = NULL;
-        s2mm_buf ret = {NULL, 0, END_OF_LIST};
-        return ret;
+    lst->mode = SG_LIST_CYCLIC;
+    lst->leasing = 0;
+    lst->to_vist = 0;
+    lst->to_release = 0;
+    lst->num_held = 0;
+    
+    volatile axidma_regs *regs = (volatile axidma_regs *) ctx->reg_base;
+    volatile axidma_chan_regs *chan = S2MM_CHAN(regs);
+    
+    if (!(chan->DMASR & 1) && halt_chan("axidma_s2mm_cyclic_start", chan) < 0) return;
+    write_desc_reg(&(chan->curdesc_lsb), &(chan->curdesc_msb), lst, 0);
+    
+    //Same as ring mode, plus the CYC_BD_EN bit
+    axidma_coalesce *co = &(ctx->coalesce[AXIDMA_S2MM]);
+    co->cur_threshold = 1;
+    chan->DMACR = coalesce_bits(co, ring_threshold(co), enable_timeout) | (0b111000000010001);
+    
+    //The tail is never reached, so the hardware goes around the whole list
+    lst->num_dirty = lst->num_entries;
+    chan->taildesc_lsb = (uint32_t) (dummy_phys & 0xFFFFFFFF);
+    chan->taildesc_msb = (uint32_t) ((dummy_phys>>32) & 0xFFFFFFFF);
+}
+
+/*
+ * Gives every dequeued buffer back to the hardware
+*/
+void axidma_s2mm_ring_release(axidma_ctx *ctx) {
+    //Validate inputs, just in case
+    if (!ctx || !ctx->lst) {
+        fprintf(stderr, "axidma_s2mm_ring_release: no SG list in context\n");
+        return;
     }
     
-    s2mm_buf ret = {
-        .base = lst->data_buf + e->data_offset,
-        .len = 0,
-        .code = TRANSFER_SUCCESS
-    };
+    sg_list *lst = ctx->lst;
+    //In cyclic mode, the hardware doesn't wait for us, so there is nothing 
+    //to give back
+    if (lst->mode == SG_LIST_CYCLIC) return;
+    if (lst->mode != SG_LIST_RING) {
+        fprintf(stderr, "axidma_s2mm_ring_release: list is not in ring mode. Did you call axidma_s2mm_ring_start?\n");
+        return;
+    }
+    adapt_coalesce(ctx, AXIDMA_S2MM);
+    if (lst->num_held == 0) return; //Nothing to do
+    
+    if (lst->leasing) {
+        lease_rearm(ctx, lst);
+        return;
+    }
+    
+    //Reset the status of every descriptor we're giving back. The hardware
+    //will refuse to use a descriptor with the complete bit still set
+    unsigned last = 0;
+    unsigned i = lst->to_release;
+    while (lst->num_held) {
+        volatile sg_descriptor *desc = sg_desc(lst, i);
+        reset_sg_status(desc);
+        flush_desc(desc);
+        last = i;
+        i = ring_next(lst, i);
+        lst->num_held--;
+    }
+    lst->to_release = i;
+    
+    //Make sure the status resets are in memory before the hardware is allowed
+    //to fetch those descriptors
+    __sync_synchronize();
+    flush_done();
+    
+    volatile axidma_regs *regs = (volatile axidma_regs *) ctx->reg_base;
+    volatile axidma_chan_regs *chan = S2MM_CHAN(regs);
+    write_tail_reg(chan, lst, last);
+}
+
+static unsigned gcd(unsigned a, unsigned b) {
+    while (b) {
+        unsigned t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+int axidma_pingpong_start(axidma_ctx *ctx, sg_list **lsts, unsigned n, int enable_timeout) {
+    //Validate inputs, just in case
+    if (!ctx || !lsts || n == 0) {
+        fprintf(stderr, "axidma_pingpong_start: invalid arguments\n");
+        return -1;
+    }
+    
+    unsigned pkts = 0;
+    for (unsigned k = 0; k < n; k++) {
+        sg_list *lst = lsts[k];
+        if (!lst || lst->num_entries == 0 || lst->num_written != lst->num_entries) {
+            fprintf(stderr, "axidma_pingpong_start: list %u has not been written. Did you forget to call axidma_write_sg_list?\n", k);
+            return -1;
+        }
+        unsigned cnt = 0;
+        for (unsigned i = 0; i < lst->num_entries; i++) {
+            if (lst->entries[i].is_EOF) cnt++;
+        }
+        pkts = gcd(pkts, cnt);
+    }
+    
+    sg_list **copy = malloc(n * sizeof(sg_list *));
+    if (!copy) {
+        perror("Could not allocate ping-pong list array");
+        return -1;
+    }
+    memcpy(copy, lsts, n * sizeof(sg_list *));
+    free(ctx->pp_lists);
+    ctx->pp_lists = copy;
+    ctx->pp_num = n;
+    ctx->pp_next = 0;
+    ctx->pp_release = 0;
+    ctx->pp_held = 0;
+    
+    //Chain the lists into one big loop by pointing the last descriptor of 
+    //each list at the first descriptor of the next one
+    for (unsigned k = 0; k < n; k++) {
+        sg_list *lst = copy[k];
+        sg_list *next = copy[(k + 1) % n];
+        volatile sg_descriptor *last = sg_desc(lst, lst->num_entries - 1);
+        desc_store64(&(last->next_desc_lsb), next->entries[0].sg_phys);
+        flush_desc(last);
+        
+        //Make axidma_write_sg_list fix this link if the list is used alone. 
+        //The hardware goes through all of it, not just up to the tail
+        lst->num_written = lst->num_entries - 1;
+        lst->num_dirty = lst->num_entries;
+        lst->mode = SG_LIST_ONESHOT;
+        lst->leasing = 0;
+        lst->to_vist = 0;
+        lst->to_release = 0;
+        lst->num_held = 0;
+    }
+    __sync_synchronize();
+    flush_done();
+    
+    //None of the other functions should touch these lists now
+    ctx->lst = NULL;
+    
+    volatile axidma_chan_regs *chan = chan_regs(ctx, AXIDMA_S2MM);
+    if (!(chan->DMASR & 1) && halt_chan("axidma_pingpong_start", chan) < 0) return -1;
+    write_desc_reg(&(chan->curdesc_lsb), &(chan->curdesc_msb), copy[0], 0);
+    
+    //If every list has the same number of packets (or a multiple of the same 
+    //number), we can get one interrupt per list
+    axidma_coalesce const *co = &(ctx->coalesce[AXIDMA_S2MM]);
+    unsigned threshold = co->threshold ? co->threshold : pick_threshold(pkts);
+    chan->DMACR = coalesce_bits(co, threshold, enable_timeout) | (0b111000000000001);
+    
+    //Give the hardware all the lists to start with
+    write_tail_reg(chan, copy[n - 1], copy[n - 1]->num_entries - 1);
+    return 0;
+}
+
+sg_list *axidma_pingpong_wait(axidma_ctx *ctx, int wait_irq) {
+    //Validate inputs, just in case
+    if (!ctx || !ctx->pp_lists) {
+        fprintf(stderr, "axidma_pingpong_wait: not in ping-pong mode. Did you call axidma_pingpong_start?\n");
+        return NULL;
+    }
+    if (ctx->pp_held == ctx->pp_num) {
+        fprintf(stderr, "axidma_pingpong_wait: every list is still held. Call axidma_pingpong_release first\n");
+        return NULL;
+    }
+    
+    //There's no limit on how many interrupts to wait for, since we don't know
+    //which list they're for. That's only safe because wait_for_desc rereads 
+    //the status from DRAM after each one, instead of trusting the cache
+    sg_list *lst = ctx->pp_lists[ctx->pp_next];
+    volatile sg_descriptor *last = sg_desc(lst, lst->num_entries - 1);
+    if (!wait_for_desc("axidma_pingpong_wait", ctx, chan_regs(ctx, AXIDMA_S2MM), last, wait_irq, 0)) {
+        return NULL;
+    }
+    
+    ctx->pp_next = (ctx->pp_next + 1) % ctx->pp_num;
+    ctx->pp_held++;
+    return lst;
+}
+
+void axidma_pingpong_release(axidma_ctx *ctx) {
+    //Validate inputs, just in case
+    if (!ctx || !ctx->pp_lists || !ctx->pp_held) {
+        fprintf(stderr, "axidma_pingpong_release: no list to release\n");
+        return;
+    }
+    
+    //Reset every descriptor, even ones whose status reads as 0. That could 
+    //be a stale cached copy of a descriptor the hardware did complete
+    sg_list *lst = ctx->pp_lists[ctx->pp_release];
+    for (unsigned i = 0; i < lst->num_entries; i++) {
+        volatile sg_descriptor *desc = sg_desc(lst, i);
+        reset_sg_status(desc);
+        flush_desc(desc);
+    }
+    lst->to_vist = 0;
+    
+    __sync_synchronize();
+    flush_done();
+    
+    volatile axidma_chan_regs *chan = chan_regs(ctx, AXIDMA_S2MM);
+    write_tail_reg(chan, lst, lst->num_entries - 1);
+    
+    ctx->pp_release = (ctx->pp_release + 1) % ctx->pp_num;
+    ctx->pp_held--;
+}
+
+//Append mode: points the last descriptor at the slot the next added entry 
+//will go in, so later submits never touch a descriptor the hardware might be
+//working on. Returns that slot's physical address, or 0 if the SG buffer is 
+//full (then the last descriptor keeps pointing at entry 0)
+static uint64_t prelink_tail(sg_list *lst) {
+    uint64_t next_phys;
+    unsigned next_offset = find_contiguous_aligned_after(&(lst->sg_idx), lst->sg_offset, sizeof(sg_descriptor), &next_phys);
+    if (next_offset == AXIDMA_NOT_FOUND || lst->num_entries >= lst->capacity) return 0;
+    
+    volatile sg_descriptor *last = sg_desc(lst, lst->num_entries - 1);
+    desc_store64(&(last->next_desc_lsb), next_phys);
+    flush_desc(last);
+    
+    //The last descriptor no longer links back to entry 0, so make 
+    //axidma_write_sg_list rewrite it if the list is used outside append mode
+    lst->num_written = lst->num_entries - 1;
+    return next_phys;
+}
+
+//Common part of axidma_s2mm_submit and axidma_mm2s_submit
+static int submit(char const *fn_name, axidma_ctx *ctx, axidma_chan_id chan_id, sg_list *lst, int enable_timeout) {
+    //Validate inputs, just in case
+    if (!ctx || !lst) {
+        fprintf(stderr, "%s: invalid NULL argument\n", fn_name);
+        return -1;
+    }
+    
+    volatile axidma_chan_regs *chan = chan_regs(ctx, chan_id);
+    sg_list **active = (chan_id == AXIDMA_MM2S) ? &(ctx->mm2s_lst) : &(ctx->lst);
+    
+    if (*active == lst && lst->mode == SG_LIST_APPEND && !(chan->DMASR & 1)) {
+        //The channel is running this list. The old tail may still be in 
+        //flight (and its next pointer already fetched), so we can't touch it.
+        //It already points at the slot the first new descriptor went in, so
+        //we just write the new descriptors and move the tail
+        unsigned first_new = lst->num_submitted;
+        if (first_new == lst->num_entries) return 0; //Nothing new
+        if (lst->entries[first_new].sg_phys != lst->prelink_phys) {
+            fprintf(stderr, "%s: new descriptors aren't where the running channel expects them\n", fn_name);
+            return -1;
+        }
+        
+        for (unsigned i = first_new; i < lst->num_entries; i++) {
+            write_sg_entry(lst, i);
+            flush_desc(sg_desc(lst, i));
+        }
+        lst->num_written = lst->num_entries;
+        lst->num_submitted = lst->num_entries;
+        lst->prelink_phys = prelink_tail(lst);
+        
+        //Make sure the descriptors are in memory before the hardware is 
+        //allowed to fetch them
+        __sync_synchronize();
+        flush_done();
+        write_tail_reg(chan, lst, lst->num_entries - 1);
+        return 0;
+    }
+    
+    //Otherwise, (re)start the channel on this list
+    if (write_sg_list(fn_name, ctx, lst, -1, NULL) < 0) return -1;
+    *active = lst;
+    if (!(chan->DMASR & 1) && halt_chan(fn_name, chan) < 0) return -1;
+    
+    lst->mode = SG_LIST_APPEND;
+    lst->num_submitted = lst->num_entries;
+    lst->prelink_phys = prelink_tail(lst);
+    __sync_synchronize();
+    flush_done();
+    
+    write_desc_reg(&(chan->curdesc_lsb), &(chan->curdesc_msb), lst, 0);
+    
+    //There's no "end" of the transfer, so by default we want to hear about 
+    //every packet
+    axidma_coalesce *co = &(ctx->coalesce[chan_id]);
+    co->cur_threshold = 1;
+    chan->DMACR = coalesce_bits(co, ring_threshold(co), enable_timeout) | (0b111000000000001);
+    
+    write_tail_reg(chan, lst, lst->num_entries - 1);
+    return 0;
+}
+
+int axidma_s2mm_submit(axidma_ctx *ctx, sg_list *lst, int enable_timeout) {
+    return submit("axidma_s2mm_submit", ctx, AXIDMA_S2MM, lst, enable_timeout);
+}
+
+int axidma_mm2s_submit(axidma_ctx *ctx, sg_list *lst, int enable_timeout) {
+    return submit("axidma_mm2s_submit", ctx, AXIDMA_MM2S, lst, enable_timeout);
+}
+
+//Simple mode version of wait_for_desc. There's no descriptor to look at, so
+//we wait for the idle bit in DMASR instead. Returns 1 if the channel is idle
+static int wait_for_idle(char const *fn_name, axidma_ctx *ctx, volatile axidma_chan_regs *chan, int wait_irq) {
+    if (wait_irq == AXIDMA_WAIT_POLL || wait_irq == AXIDMA_WAIT_HYBRID) {
+        uint64_t deadline = now_ns() + ctx->spin_ns;
+        for (unsigned iter = 1; ; iter++) {
+            uint32_t sr = chan->DMASR;
+            if (sr & DMASR_IDLE) return 1;
+            if ((sr & 1) && (sr & DMASR_ERR_MASK)) {
+                fprintf(stderr, "%s: DMA halted with error (DMASR = 0x%08x)\n", fn_name, sr);
+                return 0;
+            }
+            if (wait_irq == AXIDMA_WAIT_HYBRID && (iter & 0xFF) == 0 && now_ns() > deadline) break;
+            cpu_relax();
+        }
+        //Only AXIDMA_WAIT_HYBRID gets here, once it runs out of time
+    }
+    
+    if (wait_irq) {
+        while (!(chan->DMASR & DMASR_IDLE)) {
+            unsigned pending;
+            if (read(ctx->fd, &pending, sizeof(pending)) != sizeof(pending)) break;
+            ctx->irq_count = pending;
+            if ((chan->DMASR & 1) && (chan->DMASR & DMASR_ERR_MASK)) {
+                fprintf(stderr, "%s: DMA halted with error (DMASR = 0x%08x)\n", fn_name, chan->DMASR);
+                return 0;
+            }
+        }
+    }
+    
+    return (chan->DMASR & DMASR_IDLE) != 0;
+}
+
+int axidma_simple_wait(axidma_ctx *ctx, axidma_chan_id chan_id, int wait_irq) {
+    //Validate inputs, just in case
+    if (!ctx) {
+        fprintf(stderr, "axidma_simple_wait: invalid NULL context\n");
+        return -1;
+    }
+    
+    volatile axidma_chan_regs *chan = chan_regs(ctx, chan_id);
+    if (!wait_for_idle("axidma_simple_wait", ctx, chan, wait_irq)) return -1;
+    
+    //For S2MM, the hardware writes back how many bytes it actually received
+    return chan->length;
+}
+
+int axidma_simple_transfer(axidma_ctx *ctx, axidma_chan_id chan_id, uint64_t phys, unsigned len, int wait_irq) {
+    //Validate inputs, just in case
+    if (!ctx) {
+        fprintf(stderr, "axidma_simple_transfer: invalid NULL context\n");
+        return -1;
+    }
+    if (len == 0 || len > SIMPLE_MAX_LEN) {
+        fprintf(stderr, "axidma_simple_transfer: length must be between 1 and %u\n", SIMPLE_MAX_LEN);
+        return -1;
+    }
+    
+    volatile axidma_chan_regs *chan = chan_regs(ctx, chan_id);
+    if (chan->DMASR & DMASR_SG_INCLD) {
+        fprintf(stderr, "axidma_simple_transfer: this AXI DMA has the SG engine, so simple mode is not available\n");
+        return -1;
+    }
+    
+    //A transfer is still going if the channel is running but not idle
+    uint32_t sr = chan->DMASR;
+    if (!(sr & 1) && !(sr & DMASR_IDLE)) {
+        fprintf(stderr, "axidma_simple_transfer: channel is busy\n");
+        return -1;
+    }
+    
+    //Follows the simple mode programming sequence in the product guide: set 
+    //run/stop (plus interrupt enables), write the address, then write the 
+    //length, which starts the transfer. There's no delay timer in simple mode
+    uint32_t irq_bits = (wait_irq == AXIDMA_WAIT_POLL) ? 0b100000000000000 : 0b101000000000000;
+    chan->DMACR = irq_bits | 1;
+    chan->addr_lsb = (uint32_t) (phys & 0xFFFFFFFF);
+    chan->addr_msb = (uint32_t) ((phys>>32) & 0xFFFFFFFF);
+    
+    //Get rid of leftover interrupts so we only wait for this transfer's
+    drain_irq(ctx);
+    
+    chan->length = len;
+    
+    if (wait_irq == AXIDMA_NO_WAIT) return 0;
+    return axidma_simple_wait(ctx, chan_id, wait_irq);
+}
+
+/*
+ * Stops the S2MM channel and waits for it to halt
+*/
+void axidma_s2mm_stop(axidma_ctx *ctx) {
+    //Validate inputs, just in case
+    if (!ctx) {
+        fprintf(stderr, "axidma_s2mm_stop: invalid NULL context\n");
+        return;
+    }
+    
+    halt_chan("axidma_s2mm_stop", chan_regs(ctx, AXIDMA_S2MM));
+    if (ctx->lst) ctx->lst->mode = SG_LIST_ONESHOT;
+}
+
+//How many packet syncs dequeue_batch saves up before sending them to the 
+//pinner in one system call
+#define SYNC_BATCH 64
+
+//How many descriptors dequeue_batch invalidates at a time
+#define DESC_BATCH 16
+
+//Throws away the cached copies of the descriptors from i on (following the 
+//ring around if ring is set), so the statuses we read next come from DRAM. 
+//Only waits once, for the whole batch. Returns how many it invalidated
+static unsigned inval_descs(sg_list const *lst, unsigned i, unsigned end, int ring) {
+    unsigned count = ring ? lst->num_entries : end - i;
+    if (count > DESC_BATCH) count = DESC_BATCH;
+    for (unsigned k = 0; k < count; k++) {
+        flush_desc(sg_desc(lst, i));
+        i = ring ? ring_next(lst, i) : i + 1;
+    }
+    inval_done();
+    return count;
+}
+
+//Sends the syncs saved up by dequeue_batch, then prefetches the packets (doing 
+//that before the sync would be a waste, since the sync throws the lines away).
+//pkts[k] is the packet cmds[k] syncs. If its sync didn't work, the CPU might 
+//see stale data, so it gets marked as TRANSFER_FAILED
+static void flush_syncs(sg_list *lst, struct pinner_cmd *cmds, s2mm_buf **pkts, unsigned cnt) {
+    if (!cnt) return;
+    int results[SYNC_BATCH];
+    int done = pinner_batch(lst->data_sync_fd, cmds, results, cnt, 0);
+    unsigned num_failed = 0;
+    for (unsigned k = 0; k < cnt; k++) {
+        if (done < 0 || k >= (unsigned) done || results[k] < 0) {
+            pkts[k]->code = TRANSFER_FAILED;
+            num_failed++;
+            continue;
+        }
+        __builtin_prefetch(cmds[k].usr_buf, 0, 3);
+    }
+    if (num_failed) {
+        fprintf(stderr, "dequeue: could not sync %u of %u packets\n", num_failed, cnt);
+    }
+}
+
+/*
+ * Common part of all the dequeue functions. Walks forward from to_vist and 
+ * fills out[] with up to max packets, then returns how many it found. The 
+ * S2MM channel tells us where packets end (with the EOF bit in the status 
+ * field), but the MM2S channel doesn't, so for MM2S we use the EOF bits we 
+ * set when building the list.
+ * 
+ * Ring and cyclic mode always stop at the first packet the hardware hasn't 
+ * finished. One-shot lists only do that if only_complete is set; otherwise
+ * those packets come back as TRANSFER_FAILED
+*/
+static int dequeue_batch(sg_list *lst, s2mm_buf *out, int max, int use_sw_eof, int only_complete) {
+    unsigned i = lst->to_vist;
+    if (i == AXIDMA_NOT_FOUND) return 0;
+    
+    int ring = (lst->mode == SG_LIST_RING || lst->mode == SG_LIST_CYCLIC);
+    int append = (lst->mode == SG_LIST_APPEND);
+    if (ring || append) only_complete = 1;
+    
+    sg_entry const *entries = lst->entries;
+    unsigned num_entries = lst->num_entries;
+    //In append mode, entries that haven't been submitted aren't ours to look at
+    unsigned end = append ? lst->num_submitted : num_entries;
+    int n = 0;
     
-    //Artificially move e to the previous element, to make the do while loop 
-    //cleaner
-    e = e->prev;
-    volatile sg_descriptor *desc;
-    do {
-        e = e->next; //This "post-increment" is why we artifically moved e back
-        desc = (volatile sg_descriptor *) (lst->sg_buf + e->sg_offset);
+    //How many descriptors from i on have been invalidated by inval_descs
+    unsigned fresh = 0;
+    
+    //Syncs for the packets we return, all sent together
+    int syncing = (lst->data_sync_h && !use_sw_eof);
+    struct pinner_cmd sync_cmds[SYNC_BATCH];
+    s2mm_buf *sync_pkts[SYNC_BATCH];
+    unsigned num_syncs = 0;
+    
+    while (n < max) {
+        //If we have reached the end of the list... (in append mode, more 
+        //might get submitted later)
+        if (i >= end) {
+            if (!append) lst->to_vist = AXIDMA_NOT_FOUND;
+            break;
+        }
         
+        //Everything has been dequeued and nothing was given back yet
+        if (ring && lst->num_held == num_entries) break;
         
-        DBG_PRINT("%u", desc->control.sof);
-        DBG_PRINT("%u", desc->control.eof);
-        DBG_PRINT("%u", desc->control.len);
-        DBG_PRINT("%u", desc->status.complete);
-        DBG_PRINT("%u", desc->status.decode_err);
-        DBG_PRINT("%u", desc->status.eof);
-        DBG_PRINT("%u", desc->status.int_err);
-        DBG_PRINT("%u", desc->status.len);
-        DBG_PRINT("%u", desc->status.slave_err);
-        DBG_PRINT("%u", desc->status.sof);
-        DBG_PRINT("%08x", desc->buffer_lsb);
-        DBG_PRINT("%08x", desc->buffer_msb);
-        DBG_PRINT("%08x", desc->next_desc_lsb);
-        DBG_PRINT("%08x", desc->next_desc_msb);
+        unsigned first = i;
+        unsigned len = 0;
+        unsigned num_descs = 0;
+        int failed = 0;
+        int ready = 1;
+        for (;; i = ring ? ring_next(lst, i) : i + 1) {
+            volatile sg_descriptor *desc = sg_desc(lst, i);
+            num_descs++;
+            if (i + 1 > lst->num_dirty) lst->num_dirty = i + 1;
+            
+            //In ring mode, don't walk into descriptors that are still held 
+            //(their status is left over from the last trip around the ring)
+            if (ring && lst->num_held + num_descs > num_entries) {
+                ready = 0;
+                break;
+            }
+            
+            //Invalidate the descriptors ahead of us a batch at a time. Once a
+            //batch is invalidated it's safe to prefetch within it: if the 
+            //hardware hasn't written a descriptor yet, we just stop there, and
+            //the next call invalidates it again
+            if (fresh == 0) fresh = inval_descs(lst, i, end, ring);
+            fresh--;
+            if (fresh) __builtin_prefetch((void const *) sg_desc(lst, ring ? ring_next(lst, i) : i + 1), 0, 3);
+            uint32_t sts = desc_status(desc);
+            if (only_complete && !(sts & SG_STS_COMPLETE)) {
+                ready = 0;
+                break;
+            }
+            
+            len += sts & SG_STS_LEN_MASK;
+            if (!(sts & SG_STS_COMPLETE) || (sts & SG_STS_ERR_MASK)) failed = 1;
+            
+            //Because AXI DMA is super inconvenient, we have to do this annoying
+            //check. A ring has no end, so there a packet can wrap around
+            if (!ring && i == end - 1) break;
+            
+            int is_eof = use_sw_eof ? entries[i].is_EOF : (sts & SG_STS_EOF);
+            if (is_eof) break;
+            
+            //In a ring, a packet that runs past the end of its buffer was 
+            //longer than max_packet (and might have wrapped around to the 
+            //first buffer, so base and len can't describe it)
+            if (ring && entries[i].is_EOF) failed = 1;
+        }
         
+        //The hardware is still working on this packet. Leave to_vist alone 
+        //so we look at it again next time
+        if (!ready) break;
         
-        DBG_PRINT("%d", e == lst->sentinel.prev);
-        DBG_PRINT("%d", e == &(lst->sentinel));
-        DBG_PUTS("--");
-        ret.len += desc->status.len;
+        out[n].base = lst->data_buf + entries[first].data_offset;
+        out[n].len = len;
+        out[n].id = AXIDMA_NOT_FOUND;
+        if (lst->leasing) {
+            //The application owns these slots now. Chain them together so
+            //we can find them all again when it releases the buffer
+            unsigned prev = AXIDMA_NOT_FOUND;
+            for (unsigned c = first; ; c = ring_next(lst, c)) {
+                sg_slot *sl = lst->slots + entries[c].slot;
+                sl->leased = 1;
+                lst->num_leased++;
+                sl->next = AXIDMA_NOT_FOUND;
+                if (prev != AXIDMA_NOT_FOUND) {
+                    sg_slot *p = lst->slots + prev;
+                    p->next = entries[c].slot;
+                    //A spare swapped in here means the packet isn't 
+                    //contiguous any more
+                    if (p->data_offset + p->len != sl->data_offset) failed = 1;
+                }
+                prev = entries[c].slot;
+                if (c == i) break;
+            }
+            out[n].id = entries[first].slot;
+        }
+        out[n].code = failed ? TRANSFER_FAILED : TRANSFER_SUCCESS;
         
-        if (!desc->status.complete || desc->status.decode_err || desc->status.int_err || desc->status.slave_err) {
-            ret.code = TRANSFER_FAILED;
+        //Throw away any stale cache lines for just the bytes we received
+        if (syncing && len) {
+            sync_pkts[num_syncs] = out + n;
+            sync_range_cmd(sync_cmds + num_syncs++, lst->data_sync_h, out[n].base, len, PINNER_SYNC_FOR_CPU);
+            if (num_syncs == SYNC_BATCH) {
+                flush_syncs(lst, sync_cmds, sync_pkts, num_syncs);
+                num_syncs = 0;
+            }
+        } else {
+            //Most users look at the packet header first
+            __builtin_prefetch(out[n].base, 0, 3);
         }
-        //Because AXI DMA is super inconvenient, we have to do this annoying
-        //check
+        n++;
         
-        if (e == lst->sentinel.prev) break;
-    } while (!desc->status.eof);
+        //Update to_visit
+        if (lst->mode == SG_LIST_CYCLIC) {
+            //The hardware will set the complete bits again when it comes back 
+            //around, which is how we'll know it's been there. The resets have
+            //to reach DRAM now: if a dirty line got evicted later, it would 
+            //wipe out the status from the hardware's next lap
+            for (unsigned c = first; ; c = ring_next(lst, c)) {
+                volatile sg_descriptor *desc = sg_desc(lst, c);
+                reset_sg_status(desc);
+                flush_desc(desc);
+                if (c == i) break;
+            }
+            flush_done();
+            i = ring_next(lst, i);
+        } else if (ring) {
+            i = ring_next(lst, i);
+            lst->num_held += num_descs;
+        } else {
+            i = i + 1;
+        }
+        lst->to_vist = i;
+    }
     
-    //Update to_visit
-    lst->to_vist = e->next;
+    flush_syncs(lst, sync_cmds, sync_pkts, num_syncs);
     
-    DBG_PUTS("");
-    return ret;
+    lst->num_dequeued += n;
+    return n;
+}
+
+void axidma_set_data_sync(sg_list *lst, int pinner_fd, handle *data_h) {
+    if (!lst) return;
+    lst->data_sync_fd = pinner_fd;
+    lst->data_sync_h = data_h;
+}
+
+static s2mm_buf dequeue_buf(sg_list *lst, int use_sw_eof) {
+    if (lst->to_vist == AXIDMA_NOT_FOUND) {
+        fprintf(stderr, "Cannot dequeue buffer from empty list\n");
+        s2mm_buf ret = {NULL, 0, END_OF_LIST};
+        return ret;
+    }
+    
+    s2mm_buf ret;
+    if (dequeue_batch(lst, &ret, 1, use_sw_eof, 0) == 1) return ret;
+    
+    //In ring and cyclic mode, the list doesn't end. Instead, we have to check 
+    //if we've caught up with the hardware
+    if (lst->mode == SG_LIST_ONESHOT) {
+        s2mm_buf eol = {NULL, 0, END_OF_LIST};
+        return eol;
+    }
+    s2mm_buf not_ready = {NULL, 0, NOT_READY};
+    return not_ready;
+}
+
+/*
+ * Dequeues every finished packet (up to max) in one go
+*/
+int axidma_dequeue_s2mm_batch(sg_list *lst, s2mm_buf *out, int max) {
+    if (!lst || !out || max <= 0) return 0;
+    return dequeue_batch(lst, out, max, 0, 0);
+}
+
+int axidma_dequeue_mm2s_batch(sg_list *lst, mm2s_buf *out, int max) {
+    if (!lst || !out || max <= 0) return 0;
+    return dequeue_batch(lst, out, max, 1, 0);
+}
+
+/*
+ * Used for traversing buffers returned from an S2MM trasnfer
+*/
+s2mm_buf axidma_dequeue_s2mm_buf(sg_list *lst) {
+    return dequeue_buf(lst, 0);
+}
+
+/*
+ * Used for traversing packets sent in an MM2S transfer
+*/
+mm2s_buf axidma_dequeue_mm2s_buf(sg_list *lst) {
+    return dequeue_buf(lst, 1);
 }
 
 /*
  * Call this function if you want to re-traverse the returned buffers
 */
 void axidma_reset_lst_traversal(sg_list *lst) {
-    lst->to_vist = lst->sentinel.next;
+    //Doesn't make sense in ring or cyclic mode, since the hardware owns those
+    //buffers
+    if (lst->mode != SG_LIST_ONESHOT) return;
+    lst->to_vist = 0;
+}
+
+static int harvest(char const *fn_name, axidma_ctx *ctx, sg_list *lst, 
+                   s2mm_buf *out, int max, int use_sw_eof) 
+{
+    if (!ctx || !out) {
+        fprintf(stderr, "%s: invalid NULL argument\n", fn_name);
+        return -1;
+    }
+    if (!lst) {
+        fprintf(stderr, "%s: no list has been written to this channel\n", fn_name);
+        return -1;
+    }
+    
+    if (axidma_ack_irq(ctx) < 0) return -1;
+    adapt_coalesce(ctx, (lst == ctx->mm2s_lst) ? AXIDMA_MM2S : AXIDMA_S2MM);
+    
+    if (lst->leasing && lst->mode == SG_LIST_RING) lease_rearm(ctx, lst);
+    
+    if (max <= 0) return 0;
+    return dequeue_batch(lst, out, max, use_sw_eof, 1);
+}
+
+int axidma_s2mm_harvest(axidma_ctx *ctx, s2mm_buf *out, int max) {
+    return harvest("axidma_s2mm_harvest", ctx, ctx ? ctx->lst : NULL, out, max, 0);
+}
+
+int axidma_mm2s_harvest(axidma_ctx *ctx, mm2s_buf *out, int max) {
+    return harvest("axidma_mm2s_harvest", ctx, ctx ? ctx->mm2s_lst : NULL, out, max, 1);
 }
 
 #undef physlist
@@ -1,11 +1,37 @@
+#define _GNU_SOURCE //For MAP_HUGETLB and MADV_HUGEPAGE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include "pinner.h"
 #include "pinner_fns.h"
 
+//How many entries pin_buf_autosize makes room for on its first try. Most 
+//pinnings need fewer than this, so they only take one system call
+#define PHYSLIST_FIRST_GUESS 64
+
+//Not every libc defines these
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+#define SZ_2M (1UL << 21)
+#define SZ_1G (1UL << 30)
+
+//Rounds sz up to a multiple of align (which must be a power of two)
+#define ROUND_UP(sz, align) (((sz) + (align) - 1) & ~((size_t)(align) - 1))
+
 
 int pinner_open() {
     int fd = open("/dev/pinner", O_RDWR);
@@ -22,12 +48,19 @@ void pinner_close(int fd) {
 //Helper function to pin a buffer in RAM and get the returned handle and
 //physlist object. Returns -1 on error 
 int pin_buf(int fd, void *buf, unsigned buf_sz, struct pinner_handle *h, struct pinner_physlist *p) {
+    return pin_buf_dir(fd, buf, buf_sz, PINNER_DIR_BIDIRECTIONAL, h, p);
+}
+
+//Common part of pin_buf_dir and pin_buf_autosize. If quiet is set, don't 
+//complain about a physlist that's too small (the caller will retry)
+static int do_pin_buf(int fd, void *buf, unsigned buf_sz, unsigned dir, struct pinner_handle *h, struct pinner_physlist *p, int quiet) {
     struct pinner_cmd pin_cmd = {
         .cmd = PINNER_PIN,
         .usr_buf = buf,
         .usr_buf_sz = buf_sz,
         .handle = h,
-        .physlist = p
+        .physlist = p,
+        .flags = dir
     };
     
     if (fd == -1) {
@@ -37,7 +70,13 @@ int pin_buf(int fd, void *buf, unsigned buf_sz, struct pinner_handle *h, struct
     }
     
     int n = write(fd, &pin_cmd, sizeof(struct pinner_cmd));
-    if (n < 0) {
+    if (n < 0 && errno == ENOSPC) {
+        if (!quiet) {
+            fprintf(stderr, "Could not pin buffer: physlist has room for %u entries, but %u are needed\n", p->max_entries, p->num_entries);
+            errno = ENOSPC;
+        }
+        return -1;
+    } else if (n < 0) {
         perror("Could not write pin command to pinner");
         return -1;
     }
@@ -50,6 +89,53 @@ int pin_buf(int fd, void *buf, unsigned buf_sz, struct pinner_handle *h, struct
     return 0;
 }
 
+//Same as pin_buf, but dir is one of the PINNER_DIR_* constants. Returns -1 on
+//error
+int pin_buf_dir(int fd, void *buf, unsigned buf_sz, unsigned dir, struct pinner_handle *h, struct pinner_physlist *p) {
+    return do_pin_buf(fd, buf, buf_sz, dir, h, p, 0);
+}
+
+//Helper function to allocate a physlist with room for max_entries entries. 
+//Returns NULL on error
+struct pinner_physlist *physlist_new(unsigned max_entries) {
+    struct pinner_physlist *p = calloc(1, PINNER_PHYSLIST_SIZE(max_entries));
+    if (!p) {
+        perror("Could not allocate physlist");
+        return NULL;
+    }
+    p->max_entries = max_entries;
+    return p;
+}
+
+//Pins a buffer and allocates a physlist that's just big enough. Returns -1 on
+//error
+int pin_buf_autosize(int fd, void *buf, unsigned buf_sz, unsigned dir, struct pinner_handle *h, struct pinner_physlist **p) {
+    //Start with a guess. If it's too small, the pinner tells us how many 
+    //entries we need, so the second try always has enough room
+    unsigned guess = PINNER_PHYSLIST_WORST_CASE(buf_sz);
+    if (guess > PHYSLIST_FIRST_GUESS) guess = PHYSLIST_FIRST_GUESS;
+    
+    for (int tries = 0; tries < 2; tries++) {
+        struct pinner_physlist *plist = physlist_new(guess);
+        if (!plist) return -1;
+        
+        if (do_pin_buf(fd, buf, buf_sz, dir, h, plist, tries == 0) == 0) {
+            *p = plist;
+            return 0;
+        }
+        
+        int err = errno;
+        guess = plist->num_entries;
+        free(plist);
+        if (err != ENOSPC) {
+            errno = err;
+            return -1;
+        }
+    }
+    
+    return -1;
+}
+
 //Helper function to flush the cache on a pinned buffer. Returns -1 on error
 int flush_buf_cache(int fd, struct pinner_handle *h) {
     struct pinner_cmd flush_cmd = {
@@ -66,13 +152,100 @@ int flush_buf_cache(int fd, struct pinner_handle *h) {
     
     int n = write(fd, &flush_cmd, sizeof(struct pinner_cmd));
     if (n < 0) {
-        perror("Could not write pin command to pinner");
+        perror("Could not write flush command to pinner");
         return -1;
-    }    
-    sleep(3); //So aboslutely none of those kernel functions flush the cache...
+    }
+    
     return 0;
 }
 
+//Helper function to sync part of a pinned buffer. Returns -1 on error
+int sync_buf_range(int fd, struct pinner_handle *h, void const *start, unsigned len, unsigned flags) {
+    struct pinner_cmd sync_cmd = {
+        .cmd = PINNER_SYNC_RANGE,
+        .usr_buf = (void *) start,
+        .usr_buf_sz = len,
+        .handle = h,
+        .flags = flags
+    };
+    
+    if (fd == -1) {
+        fprintf(stderr, "Error: invalid file descriptor. Did open_pinner() fail?");
+        errno = EINVAL;
+        return -1;
+    }
+    
+    int n = write(fd, &sync_cmd, sizeof(struct pinner_cmd));
+    if (n < 0) {
+        perror("Could not write sync command to pinner");
+        return -1;
+    }
+    
+    return 0;
+}
+
+//Fills in a PINNER_SYNC_RANGE command, for use with pinner_batch
+void sync_range_cmd(struct pinner_cmd *cmd, struct pinner_handle *h, void const *start, unsigned len, unsigned flags) {
+    memset(cmd, 0, sizeof(struct pinner_cmd));
+    cmd->cmd = PINNER_SYNC_RANGE;
+    cmd->usr_buf = (void *) start;
+    cmd->usr_buf_sz = len;
+    cmd->handle = h;
+    cmd->flags = flags;
+}
+
+//Fills in a PINNER_PIN command, for use with pinner_batch
+void pin_cmd(struct pinner_cmd *cmd, void *buf, unsigned buf_sz, unsigned dir, struct pinner_handle *h, struct pinner_physlist *p) {
+    memset(cmd, 0, sizeof(struct pinner_cmd));
+    cmd->cmd = PINNER_PIN;
+    cmd->usr_buf = buf;
+    cmd->usr_buf_sz = buf_sz;
+    cmd->handle = h;
+    cmd->physlist = p;
+    cmd->flags = dir;
+}
+
+//Fills in a PINNER_UNPIN command, for use with pinner_batch
+void unpin_cmd(struct pinner_cmd *cmd, struct pinner_handle *h) {
+    memset(cmd, 0, sizeof(struct pinner_cmd));
+    cmd->cmd = PINNER_UNPIN;
+    cmd->handle = h;
+}
+
+//Helper function to run several commands with (about) one system call. 
+//Returns how many commands were run, or -1 on error
+int pinner_batch(int fd, struct pinner_cmd *cmds, int *results, unsigned num_cmds, unsigned flags) {
+    if (fd == -1) {
+        fprintf(stderr, "Error: invalid file descriptor. Did open_pinner() fail?");
+        errno = EINVAL;
+        return -1;
+    }
+    
+    //The driver only takes PINNER_MAX_BATCH at a time
+    unsigned done = 0;
+    while (done < num_cmds) {
+        unsigned n = num_cmds - done;
+        if (n > PINNER_MAX_BATCH) n = PINNER_MAX_BATCH;
+        
+        struct pinner_batch batch = {
+            .cmds = cmds + done,
+            .results = results ? results + done : NULL,
+            .num_cmds = n,
+            .flags = flags
+        };
+        int rc = ioctl(fd, PINNER_IOC_BATCH, &batch);
+        if (rc < 0) {
+            perror("Could not run batch of pinner commands");
+            return -1;
+        }
+        
+        done += rc;
+        if ((unsigned) rc < n) break; //Stopped on an error
+    }
+    
+    return done;
+}
+
 //Helper function to unpin a buffer. Returns -1 on error
 int unpin_buf(int fd, struct pinner_handle *h) {
     struct pinner_cmd unpin_cmd = {
@@ -94,3 +267,412 @@ int unpin_buf(int fd, struct pinner_handle *h) {
     
     return 0;
 }
+
+//Helper function to count (or wait for) unpins that haven't finished yet. 
+//Returns -1 on error
+int unpin_pending(int fd, int wait) {
+    unsigned pending = 0;
+    struct pinner_cmd pending_cmd = {
+        .cmd = PINNER_PENDING,
+        .usr_buf = &pending,
+        .flags = wait ? PINNER_PENDING_WAIT : 0
+    };
+    
+    if (fd == -1) {
+        fprintf(stderr, "Error: invalid file descriptor. Did open_pinner() fail?");
+        errno = EINVAL;
+        return -1;
+    }
+    
+    int n = write(fd, &pending_cmd, sizeof(struct pinner_cmd));
+    if (n < 0) {
+        perror("Could not write pending command to pinner");
+        return -1;
+    }
+    
+    return pending;
+}
+
+//Tries to mmap sz bytes of hugetlbfs pages of the given size. Returns 
+//MAP_FAILED if the system doesn't have enough of them
+static void *mmap_hugetlb(size_t sz, int size_flag) {
+    return mmap(NULL, sz, PROT_READ | PROT_WRITE, 
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | size_flag, -1, 0);
+}
+
+//Maps sz bytes (a multiple of 2 MiB) aligned to 2 MiB, and asks the kernel to 
+//back it with transparent huge pages. Returns MAP_FAILED on error
+static void *mmap_thp(size_t sz) {
+    //Map an extra 2 MiB so we can trim it down to an aligned region
+    size_t padded = sz + SZ_2M;
+    char *raw = mmap(NULL, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return MAP_FAILED;
+    
+    char *aligned = (char *) ROUND_UP((uintptr_t) raw, SZ_2M);
+    size_t head = aligned - raw;
+    size_t tail = padded - head - sz;
+    if (head) munmap(raw, head);
+    if (tail) munmap(aligned + sz, tail);
+    
+    //If THP is disabled this fails, but we still have perfectly good memory
+    if (madvise(aligned, sz, MADV_HUGEPAGE) < 0) {
+        perror("Warning: could not madvise for transparent huge pages");
+    }
+    return aligned;
+}
+
+//Helper function to allocate a buffer backed by huge pages (if possible) and
+//pin it. Returns -1 on error
+int alloc_pinned_buf(int fd, unsigned sz, int flags, struct pinned_buf *b) {
+    if (!b || !sz) {
+        fprintf(stderr, "Error: alloc_pinned_buf: invalid argument\n");
+        errno = EINVAL;
+        return -1;
+    }
+    
+    void *buf = MAP_FAILED;
+    size_t map_sz = 0;
+    int used = 0;
+    
+    //Try the page sizes from biggest to smallest
+    if (flags & PINNED_BUF_HUGE_1G) {
+        map_sz = ROUND_UP(sz, SZ_1G);
+        buf = mmap_hugetlb(map_sz, MAP_HUGE_1GB);
+        used = PINNED_BUF_HUGE_1G;
+    }
+    if (buf == MAP_FAILED && (flags & PINNED_BUF_HUGE_2M)) {
+        map_sz = ROUND_UP(sz, SZ_2M);
+        buf = mmap_hugetlb(map_sz, MAP_HUGE_2MB);
+        used = PINNED_BUF_HUGE_2M;
+    }
+    if (buf == MAP_FAILED && (flags & PINNED_BUF_THP)) {
+        map_sz = ROUND_UP(sz, SZ_2M);
+        buf = mmap_thp(map_sz);
+        used = PINNED_BUF_THP;
+    }
+    if (buf == MAP_FAILED) {
+        map_sz = ROUND_UP(sz, (size_t) sysconf(_SC_PAGESIZE));
+        buf = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        used = 0;
+    }
+    if (buf == MAP_FAILED) {
+        perror("Could not allocate memory for pinned buffer");
+        return -1;
+    }
+    
+    //Pinning faults in all the pages, so this is when the huge pages actually
+    //get allocated
+    struct pinner_physlist *plist;
+    if (pin_buf_autosize(fd, buf, sz, PINNER_DIR_BIDIRECTIONAL, &(b->h), &plist) < 0) {
+        munmap(buf, map_sz);
+        return -1;
+    }
+    
+    b->buf = buf;
+    b->sz = sz;
+    b->map_sz = map_sz;
+    b->flags = used;
+    b->plist = plist;
+    return 0;
+}
+
+//Helper function to allocate DMA-coherent memory from the pinner and mmap it.
+//Returns -1 on error
+int alloc_coherent_buf(int fd, unsigned sz, unsigned flags, struct pinned_buf *b) {
+    if (!b || !sz) {
+        fprintf(stderr, "Error: alloc_coherent_buf: invalid argument\n");
+        errno = EINVAL;
+        return -1;
+    }
+    
+    if (fd == -1) {
+        fprintf(stderr, "Error: invalid file descriptor. Did open_pinner() fail?");
+        errno = EINVAL;
+        return -1;
+    }
+    
+    struct pinner_physlist *plist = physlist_new(1);
+    if (!plist) return -1;
+    
+    struct pinner_cmd alloc_cmd = {
+        .cmd = PINNER_ALLOC,
+        .usr_buf_sz = sz,
+        .handle = &(b->h),
+        .physlist = plist,
+        .flags = flags
+    };
+    
+    int n = write(fd, &alloc_cmd, sizeof(struct pinner_cmd));
+    if (n < 0) {
+        perror("Could not write alloc command to pinner");
+        free(plist);
+        return -1;
+    }
+    
+    size_t pg_sz = (size_t) sysconf(_SC_PAGESIZE);
+    size_t map_sz = ROUND_UP(sz, pg_sz);
+    void *buf = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 
+                     (off_t) PINNER_MMAP_PGOFF(b->h) * pg_sz);
+    if (buf == MAP_FAILED) {
+        perror("Could not mmap coherent buffer");
+        unpin_buf(fd, &(b->h));
+        free(plist);
+        return -1;
+    }
+    
+    b->buf = buf;
+    b->sz = sz;
+    b->map_sz = map_sz;
+    b->flags = PINNED_BUF_COHERENT;
+    b->plist = plist;
+    return 0;
+}
+
+//Helper function to unpin and free a buffer from alloc_pinned_buf or 
+//alloc_coherent_buf
+void free_pinned_buf(int fd, struct pinned_buf *b) {
+    if (!b || !b->buf) return;
+    if (b->flags & PINNED_BUF_COHERENT) {
+        //The pinner won't free coherent memory while it's still mapped
+        munmap(b->buf, b->map_sz);
+        unpin_buf(fd, &(b->h));
+    } else {
+        unpin_buf(fd, &(b->h));
+        munmap(b->buf, b->map_sz);
+    }
+    free(b->plist);
+    b->buf = NULL;
+    b->plist = NULL;
+}
+
+//One pinning in a pin_cache. Entries are kept in a doubly-linked list, most 
+//recently used first, so eviction starts from the tail
+struct pin_cache_entry {
+    char *buf;
+    unsigned sz;
+    unsigned dir;
+    struct pinner_handle h;
+    struct pinner_physlist *plist;
+    unsigned refs; //Number of pin_cache_gets without a matching put
+    struct pin_cache_entry *prev, *next;
+};
+
+struct pin_cache {
+    int fd;
+    unsigned max_unused;
+    unsigned num_unused;
+    struct pin_cache_entry *head, *tail;
+};
+
+struct pin_cache *pin_cache_new(int fd, unsigned max_unused) {
+    if (fd == -1) {
+        fprintf(stderr, "Error: invalid file descriptor. Did open_pinner() fail?");
+        errno = EINVAL;
+        return NULL;
+    }
+    
+    struct pin_cache *c = calloc(1, sizeof(struct pin_cache));
+    if (!c) {
+        perror("Could not allocate pin cache");
+        return NULL;
+    }
+    c->fd = fd;
+    c->max_unused = max_unused;
+    return c;
+}
+
+static void pin_cache_unlink(struct pin_cache *c, struct pin_cache_entry *e) {
+    if (e->prev) e->prev->next = e->next;
+    else c->head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else c->tail = e->prev;
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void pin_cache_push_front(struct pin_cache *c, struct pin_cache_entry *e) {
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head) c->head->prev = e;
+    else c->tail = e;
+    c->head = e;
+}
+
+//Unpins an (unused) entry and frees it
+static void pin_cache_drop(struct pin_cache *c, struct pin_cache_entry *e) {
+    pin_cache_unlink(c, e);
+    if (e->refs == 0) c->num_unused--;
+    unpin_buf(c->fd, &(e->h));
+    free(e->plist);
+    free(e);
+}
+
+//Unpins unused entries, least recently used first, until there are at most 
+//keep of them. Returns how many were unpinned
+static unsigned pin_cache_evict(struct pin_cache *c, unsigned keep) {
+    unsigned dropped = 0;
+    struct pin_cache_entry *e = c->tail;
+    while (e && c->num_unused > keep) {
+        struct pin_cache_entry *prev = e->prev;
+        if (e->refs == 0) {
+            pin_cache_drop(c, e);
+            dropped++;
+        }
+        e = prev;
+    }
+    return dropped;
+}
+
+void pin_cache_free(struct pin_cache *c) {
+    if (!c) return;
+    while (c->head) {
+        if (c->head->refs != 0) {
+            fprintf(stderr, "Warning: freeing pin cache with a buffer still in use\n");
+        }
+        pin_cache_drop(c, c->head);
+    }
+    free(c);
+}
+
+//Can a pinning made with direction have be used for direction want?
+static int dir_compatible(unsigned have, unsigned want) {
+    return have == PINNER_DIR_BIDIRECTIONAL || have == want;
+}
+
+//Copies the part of e's physlist that covers buf to buf+buf_sz into a new 
+//physlist. Returns NULL on error
+static struct pinner_physlist *physlist_slice(struct pin_cache_entry *e, char *buf, unsigned buf_sz) {
+    unsigned skip = buf - e->buf;
+    unsigned i = 0;
+    while (skip >= e->plist->entries[i].len) {
+        skip -= e->plist->entries[i].len;
+        i++;
+    }
+    
+    //Count how many entries we need before allocating
+    unsigned n = 0;
+    unsigned left = buf_sz + skip;
+    for (unsigned j = i; left > 0; j++) {
+        unsigned len = e->plist->entries[j].len;
+        left -= (len < left) ? len : left;
+        n++;
+    }
+    
+    struct pinner_physlist *p = physlist_new(n);
+    if (!p) return NULL;
+    
+    left = buf_sz;
+    for (unsigned j = 0; j < n; j++) {
+        unsigned long addr = e->plist->entries[i+j].addr + skip;
+        unsigned len = e->plist->entries[i+j].len - skip;
+        if (len > left) len = left;
+        p->entries[j].addr = addr;
+        p->entries[j].len = len;
+        left -= len;
+        skip = 0;
+    }
+    p->num_entries = n;
+    
+    return p;
+}
+
+int pin_cache_get(struct pin_cache *c, void *buf, unsigned buf_sz, unsigned dir, struct pinner_handle *h, struct pinner_physlist **p) {
+    char *start = buf;
+    
+    if (buf_sz == 0) {
+        fprintf(stderr, "Error: can't pin an empty buffer\n");
+        errno = EINVAL;
+        return -1;
+    }
+    
+    //Look for a pinning that covers the whole range
+    for (struct pin_cache_entry *e = c->head; e; e = e->next) {
+        if (buf_sz > e->sz || start < e->buf || start - e->buf > e->sz - buf_sz) continue;
+        if (!dir_compatible(e->dir, dir)) continue;
+        
+        struct pinner_physlist *plist = e->plist;
+        if (start != e->buf || buf_sz != e->sz) {
+            plist = physlist_slice(e, start, buf_sz);
+            if (!plist) return -1;
+        }
+        
+        if (e->refs++ == 0) c->num_unused--;
+        pin_cache_unlink(c, e);
+        pin_cache_push_front(c, e);
+        *h = e->h;
+        *p = plist;
+        return 0;
+    }
+    
+    //Not cached, so pin it for real
+    struct pin_cache_entry *e = calloc(1, sizeof(struct pin_cache_entry));
+    if (!e) {
+        perror("Could not allocate pin cache entry");
+        return -1;
+    }
+    
+    if (pin_buf_autosize(c->fd, buf, buf_sz, dir, &(e->h), &(e->plist)) < 0) {
+        //Maybe we hit the locked memory limit. If there's anything we can
+        //unpin, do that and try once more
+        if (errno == ENOSPC || pin_cache_evict(c, 0) == 0 ||
+            pin_buf_autosize(c->fd, buf, buf_sz, dir, &(e->h), &(e->plist)) < 0)
+        {
+            int err = errno;
+            free(e);
+            errno = err;
+            return -1;
+        }
+    }
+    
+    e->buf = start;
+    e->sz = buf_sz;
+    e->dir = dir;
+    e->refs = 1;
+    pin_cache_push_front(c, e);
+    *h = e->h;
+    *p = e->plist;
+    return 0;
+}
+
+void pin_cache_put(struct pin_cache *c, struct pinner_handle *h, struct pinner_physlist *p) {
+    for (struct pin_cache_entry *e = c->head; e; e = e->next) {
+        if (e->h.pin_magic != h->pin_magic || e->h.user_magic != h->user_magic) continue;
+        
+        //Slices are copies, but a whole-buffer get hands out the entry's own
+        if (p != e->plist) free(p);
+        if (e->refs == 0) {
+            fprintf(stderr, "Warning: pin_cache_put called too many times\n");
+            return;
+        }
+        if (--e->refs == 0) {
+            c->num_unused++;
+            pin_cache_evict(c, c->max_unused);
+        }
+        return;
+    }
+    
+    fprintf(stderr, "Warning: pin_cache_put called with a handle that isn't in the cache\n");
+}
+
+int pin_cache_invalidate(struct pin_cache *c, void const *buf, unsigned buf_sz) {
+    char const *start = buf;
+    char const *end = start + buf_sz;
+    int busy = 0;
+    
+    struct pin_cache_entry *e = c->head;
+    while (e) {
+        struct pin_cache_entry *next = e->next;
+        if (e->buf < end && start < e->buf + e->sz) {
+            if (e->refs == 0) pin_cache_drop(c, e);
+            else busy = 1;
+        }
+        e = next;
+    }
+    
+    if (busy) {
+        fprintf(stderr, "Warning: pin_cache_invalidate on a buffer that's still in use\n");
+        errno = EBUSY;
+        return -1;
+    }
+    return 0;
+}